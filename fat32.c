@@ -0,0 +1,3755 @@
+// The MIT License (MIT)
+// 
+// Copyright (c) 2020 Trevor Bakker 
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fat32_internal.h"
+
+//Returns a pointer to len bytes of the image at offset when it is mapped,
+//or NULL when the bytes have to be read from the fd.
+static const void *imagePtr(struct Image *img, long offset, size_t len)
+{
+    if(img->map == NULL || offset < 0 || (size_t)offset > img->size || len > img->size - offset)
+    {
+        return NULL;
+    }
+    return img->map + offset;
+}
+
+//Copies len bytes at offset in the image into buf. Returns the bytes read,
+//short of len when the image ends or can't be read.
+static size_t readImage(struct Image *img, void *buf, size_t len, long offset)
+{
+    //A mapped image has nothing past its end, a read crossing it is cut
+    //short there
+    if(img->map != NULL)
+    {
+        if(offset < 0 || (size_t)offset >= img->size)
+        {
+            return 0;
+        }
+        if(len > img->size - offset)
+        {
+            len = img->size - offset;
+        }
+        memcpy(buf, img->map + offset, len);
+        return len;
+    }
+
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = pread(img->fd, (unsigned char*) buf + done, len - done, offset + done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            break;
+        }
+        done = done + n;
+    }
+    return done;
+}
+
+//Maps the open image read-only. Returns 0 on success.
+static int mapImage(struct Image *img)
+{
+    struct stat st;
+
+    if(fstat(img->fd, &st) != 0 || st.st_size == 0)
+    {
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, img->fd, 0);
+    if(map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    img->map = (unsigned char*) map;
+    img->size = st.st_size;
+    return 0;
+}
+
+static void unmapImage(struct Image *img)
+{
+    if(img->map != NULL)
+    {
+        munmap(img->map, img->size);
+        img->map = NULL;
+        img->size = 0;
+    }
+}
+
+// Only the low 28 bits of a FAT32 entry hold the next cluster number
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+// Entries at or above this value mark the end of a cluster chain
+#define FAT_EOC 0x0FFFFFF8
+
+//Reads the whole first FAT into the FAT table. Returns 0 on success.
+int fat32__loadFAT(struct Image *img)
+{
+    size_t FATBytes = (size_t)img->BPB_FATSz32 * img->BPB_BytesPerSec;
+    long FATOffset = img->BPB_BytesPerSec * img->BPB_RsvdSecCnt;
+
+    img->FAT = (uint32_t*) imagePtr(img, FATOffset, FATBytes);
+    if(img->FAT != NULL)
+    {
+        img->FATMapped = true;
+        img->FATEntries = FATBytes / sizeof(uint32_t);
+        return 0;
+    }
+
+    img->FAT = (uint32_t*) malloc(FATBytes);
+    if(img->FAT == NULL)
+    {
+        return -1;
+    }
+
+    if(readImage(img, img->FAT, FATBytes, FATOffset) != FATBytes)
+    {
+        free(img->FAT);
+        img->FAT = NULL;
+        return -1;
+    }
+
+    img->FATEntries = FATBytes / sizeof(uint32_t);
+    return 0;
+}
+
+void fat32__freeFAT(struct Image *img)
+{
+    if(!img->FATMapped)
+    {
+        free(img->FAT);
+    }
+    img->FAT = NULL;
+    img->FATMapped = false;
+    img->FATEntries = 0;
+}
+
+//Returns the cluster that follows the given one in its chain. Served from
+//the FAT table when it is loaded, otherwise read straight from the image.
+static uint32_t NextLB(struct Image *img, uint32_t sector)
+{
+    if(img->FAT != NULL && sector < img->FATEntries)
+    {
+        return img->FAT[sector] & FAT_ENTRY_MASK;
+    }
+
+    uint32_t FATAddress = (img->BPB_BytesPerSec*img->BPB_RsvdSecCnt)+(sector*4);
+    uint32_t val = 0;
+    readImage(img, &val, 4, FATAddress);
+    return val & FAT_ENTRY_MASK;
+}
+
+// Follows a cluster chain and notices when it loops back on itself. The
+// chain is compared against a marked cluster that moves ahead at doubling
+// distances (Brent's method), so a loop is caught within twice its length
+// without remembering every cluster. No chain is longer than the volume.
+struct ChainWalk
+{
+    uint32_t mark;
+    uint32_t power;
+    uint32_t steps;
+    uint32_t hops;
+};
+
+static void chainStart(struct ChainWalk *walk, uint32_t cluster)
+{
+    walk->mark = cluster;
+    walk->power = 1;
+    walk->steps = 0;
+    walk->hops = 0;
+}
+
+//Moves *cluster to the next one in its chain. Returns false when the chain
+//has looped or run longer than the volume, the walk should stop there.
+static bool chainNext(struct Image *img, struct ChainWalk *walk, uint32_t *cluster)
+{
+    *cluster = NextLB(img, *cluster);
+    if(*cluster == walk->mark || ++walk->hops > img->ClusterCount)
+    {
+        return false;
+    }
+    if(++walk->steps == walk->power)
+    {
+        walk->mark = *cluster;
+        walk->power *= 2;
+        walk->steps = 0;
+    }
+    return true;
+}
+
+//Returns the byte offset in the image of the first sector of a cluster
+static long LBAToOffset(struct Image *img, uint32_t cluster)
+{
+    return ((long)(cluster - 2) * img->BytesPerCluster) + ((long)img->BPB_BytesPerSec * img->BPB_RsvdSecCnt) + ((long)img->BPB_NumFATS * img->BPB_FATSz32 * img->BPB_BytesPerSec);
+}
+
+//First cluster of a directory entry, including the high word
+uint32_t fat32__firstCluster(struct DirectoryEntry *entry)
+{
+    return ((uint32_t)entry->DIR_FirstClusterHigh << 16) | entry->DIR_FirstClusterLow;
+}
+
+//Returns true when the cluster number can hold data
+static bool validCluster(uint32_t cluster)
+{
+    return cluster >= 2 && cluster < FAT_EOC;
+}
+
+static void cacheUnlink(struct Image *img, struct CacheBlock *block)
+{
+    if(block->prev != NULL)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        img->cache.head = block->next;
+    }
+
+    if(block->next != NULL)
+    {
+        block->next->prev = block->prev;
+    }
+    else
+    {
+        img->cache.tail = block->prev;
+    }
+}
+
+static void cachePushFront(struct Image *img, struct CacheBlock *block)
+{
+    block->prev = NULL;
+    block->next = img->cache.head;
+    if(img->cache.head != NULL)
+    {
+        img->cache.head->prev = block;
+    }
+    img->cache.head = block;
+    if(img->cache.tail == NULL)
+    {
+        img->cache.tail = block;
+    }
+}
+
+static struct CacheBlock *cacheFind(struct Image *img, uint32_t cluster)
+{
+    struct CacheBlock *block = img->cache.buckets[cluster % img->cache.bucketCount];
+
+    while(block != NULL && block->cluster != cluster)
+    {
+        block = block->hashNext;
+    }
+    return block;
+}
+
+static void cacheEvict(struct Image *img, struct CacheBlock *block)
+{
+    struct CacheBlock **link = &img->cache.buckets[block->cluster % img->cache.bucketCount];
+
+    while(*link != block)
+    {
+        link = &(*link)->hashNext;
+    }
+    *link = block->hashNext;
+
+    cacheUnlink(img, block);
+    free(block->data);
+    free(block);
+    img->cache.count--;
+}
+
+//Empties the cache, keeping its size and readahead settings
+void fat32__cacheClear(struct Image *img)
+{
+    while(img->cache.tail != NULL)
+    {
+        cacheEvict(img, img->cache.tail);
+    }
+    free(img->cache.buckets);
+    img->cache.buckets = NULL;
+    img->cache.bucketCount = 0;
+    img->cache.lastCluster = 0;
+}
+
+//Puts a cluster read by cacheCopyCluster at the front of the list, evicting
+//the least recently used block when the cache is full. Another reader may
+//have added the same cluster while this one was reading, then its block
+//is kept and data is freed. Called with the lock held.
+static void cacheInsert(struct Image *img, uint32_t cluster, unsigned char *data, bool prefetched)
+{
+    if(img->cache.capacity <= 0 || (img->cache.buckets != NULL && cacheFind(img, cluster) != NULL))
+    {
+        free(data);
+        return;
+    }
+
+    if(img->cache.buckets == NULL)
+    {
+        img->cache.bucketCount = img->cache.capacity * 2 + 1;
+        img->cache.buckets = (struct CacheBlock**) calloc(img->cache.bucketCount, sizeof(struct CacheBlock*));
+    }
+
+    while(img->cache.count >= img->cache.capacity && img->cache.tail != NULL)
+    {
+        cacheEvict(img, img->cache.tail);
+    }
+
+    struct CacheBlock *block = (struct CacheBlock*) malloc(sizeof(struct CacheBlock));
+    block->cluster = cluster;
+    block->data = data;
+    block->prefetched = prefetched;
+
+    block->hashNext = img->cache.buckets[cluster % img->cache.bucketCount];
+    img->cache.buckets[cluster % img->cache.bucketCount] = block;
+    cachePushFront(img, block);
+    img->cache.count++;
+}
+
+//Copies len bytes of a cluster starting at byteOffset into buf through the
+//block cache. Only the lookup and the insert hold the lock; a miss is read
+//without it, so one reader's I/O doesn't hold up the others. Behind a
+//sequential reader the clusters stored right after the missed one are
+//fetched in the same read. Returns the bytes copied, fewer than len when
+//the image can't be read; clusters that were not read whole aren't cached.
+static uint32_t cacheCopyCluster(struct Image *img, unsigned char *buf, uint32_t cluster, uint32_t byteOffset, uint32_t len)
+{
+    pthread_mutex_lock(&img->lock);
+    struct CacheBlock *block = img->cache.buckets ? cacheFind(img, cluster) : NULL;
+    uint32_t lastCluster = img->cache.lastCluster;
+    img->cache.lastCluster = cluster;
+
+    //Cached blocks can be evicted by another reader once the lock is
+    //dropped, so the bytes are copied out while it is held
+    if(block != NULL)
+    {
+        img->cache.hits++;
+        img->cache.bytesSaved = img->cache.bytesSaved + len;
+        if(block->prefetched)
+        {
+            img->cache.prefetched++;
+            block->prefetched = false;
+        }
+        cacheUnlink(img, block);
+        cachePushFront(img, block);
+        memcpy(buf, block->data + byteOffset, len);
+        pthread_mutex_unlock(&img->lock);
+        return len;
+    }
+
+    img->cache.misses++;
+    int ahead = img->cache.readahead < img->cache.capacity - 1 ? img->cache.readahead : img->cache.capacity - 1;
+    pthread_mutex_unlock(&img->lock);
+
+    //The readahead covers the part of the chain that is contiguous on disk,
+    //never more than would push the requested block out
+    int count = 1;
+    if(ahead > 0 && validCluster(lastCluster) && NextLB(img, lastCluster) == cluster)
+    {
+        uint32_t current = cluster;
+        while(count <= ahead && NextLB(img, current) == current + 1)
+        {
+            current++;
+            count++;
+        }
+    }
+
+    unsigned char *run = (unsigned char*) malloc((size_t) count * img->BytesPerCluster);
+    size_t got = readImage(img, run, (size_t) count * img->BytesPerCluster, LBAToOffset(img, cluster));
+    uint32_t copied = got <= byteOffset ? 0 : got - byteOffset < len ? got - byteOffset : len;
+    memcpy(buf, run + byteOffset, copied);
+
+    //Prefetched blocks go in first so the requested one ends up in front
+    pthread_mutex_lock(&img->lock);
+    for(int n = (int) (got / img->BytesPerCluster) - 1; n >= 0; n--)
+    {
+        unsigned char *data = (unsigned char*) malloc(img->BytesPerCluster);
+        memcpy(data, run + (size_t) n * img->BytesPerCluster, img->BytesPerCluster);
+        cacheInsert(img, cluster + n, data, n > 0);
+    }
+    pthread_mutex_unlock(&img->lock);
+
+    free(run);
+    return copied;
+}
+
+//Returns a pointer to len bytes of the cluster starting at byteOffset. It
+//points into the mapping in mmap mode, otherwise the bytes are copied into
+//buf from the block cache or read into it in one I/O. got is set to how
+//many of the bytes could be read.
+static const unsigned char *readCluster(struct Image *img, unsigned char *buf, uint32_t cluster, uint32_t byteOffset, uint32_t len,
+                                 uint32_t *got)
+{
+    long offset = LBAToOffset(img, cluster) + byteOffset;
+    const unsigned char *src = (const unsigned char*) imagePtr(img, offset, len);
+
+    *got = len;
+    if(src == NULL && img->cache.capacity > 0)
+    {
+        *got = cacheCopyCluster(img, buf, cluster, byteOffset, len);
+        src = buf;
+    }
+    else if(src == NULL)
+    {
+        *got = readImage(img, buf, len, offset);
+        src = buf;
+    }
+    return src;
+}
+
+// Streams the entries of a directory by following its cluster chain
+// through the FAT. Entries are handed out one cluster (batch) at a time,
+// so a directory of any size is scanned without being loaded whole.
+struct DirIterator
+{
+    struct Image *img;
+    uint32_t cluster;
+    struct ChainWalk walk;
+    struct DirectoryEntry *batch;
+    uint32_t batchCount;
+    uint32_t index;
+    unsigned char *buffer;
+    bool done;
+};
+
+//Loads the batch of entries held by it->cluster
+static void dirLoadBatch(struct DirIterator *it)
+{
+    if(!validCluster(it->cluster))
+    {
+        it->done = true;
+        return;
+    }
+
+    //Only the entries that could be read whole are handed out
+    uint32_t got;
+    it->batch = (struct DirectoryEntry*) readCluster(it->img, it->buffer, it->cluster, 0, it->img->BytesPerCluster, &got);
+    it->batchCount = got / sizeof(struct DirectoryEntry);
+    it->index = 0;
+}
+
+static void dirOpen(struct DirIterator *it, struct Image *img, uint32_t cluster)
+{
+    memset(it, 0, sizeof(*it));
+    it->img = img;
+    it->cluster = cluster;
+    it->buffer = (unsigned char*) malloc(img->BytesPerCluster);
+    chainStart(&it->walk, cluster);
+    dirLoadBatch(it);
+}
+
+//Returns the next entry of the directory, or NULL once the end marker or
+//the end of the chain is reached. The entry is valid until the next call.
+static struct DirectoryEntry *dirNext(struct DirIterator *it)
+{
+    while(!it->done)
+    {
+        if(it->index < it->batchCount)
+        {
+            struct DirectoryEntry *entry = &it->batch[it->index++];
+
+            //A name starting with 0 marks the end of the directory
+            if(entry->DIR_Name[0] == 0)
+            {
+                it->done = true;
+                return NULL;
+            }
+            return entry;
+        }
+
+        //A directory whose chain loops ends where it comes around, and none
+        //can hold more than DIR_MAX_ENTRIES
+        if(!chainNext(it->img, &it->walk, &it->cluster)
+           || (uint64_t)(it->walk.hops + 1) * it->img->BytesPerCluster > DIR_MAX_ENTRIES * sizeof(struct DirectoryEntry))
+        {
+            it->done = true;
+        }
+        else
+        {
+            dirLoadBatch(it);
+        }
+    }
+    return NULL;
+}
+
+static void dirClose(struct DirIterator *it)
+{
+    free(it->buffer);
+    it->buffer = NULL;
+}
+
+//Cluster a directory entry points at, with 0 standing for the root
+uint32_t fat32__dirCluster(struct Image *img, struct DirectoryEntry *entry)
+{
+    uint32_t cluster = fat32__firstCluster(entry);
+    if(cluster == 0)
+    {
+        cluster = img->BPB_RootClus;
+    }
+    return cluster;
+}
+
+//Returns the node whose chain starts at cluster, or NULL
+static const struct SidecarNode *sidecarFind(struct Image *img, uint32_t cluster)
+{
+    struct Sidecar *sidecar = img->sidecar;
+    uint32_t low = 0;
+    uint32_t high;
+
+    if(sidecar == NULL)
+    {
+        return NULL;
+    }
+
+    high = sidecar->header->keyCount;
+    while(low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if(sidecar->keys[middle].cluster < cluster)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if(low < sidecar->header->keyCount && sidecar->keys[low].cluster == cluster)
+    {
+        return &sidecar->nodes[sidecar->keys[low].node];
+    }
+    return NULL;
+}
+
+//FNV-1a over the entries of FAT #1, so an index is only trusted while the
+//allocation it describes is unchanged
+static uint64_t fatChecksum(struct Image *img)
+{
+    size_t entries = (size_t)img->BPB_FATSz32 * img->BPB_BytesPerSec / sizeof(uint32_t);
+    long FATOffset = img->BPB_BytesPerSec * img->BPB_RsvdSecCnt;
+    uint64_t hash = 14695981039346656037ull;
+    uint32_t chunk[4096];
+    size_t i;
+
+    for(i = 0; i < entries; i++)
+    {
+        uint32_t value;
+
+        if(img->FAT != NULL)
+        {
+            value = img->FAT[i];
+        }
+        else
+        {
+            if(i % 4096 == 0)
+            {
+                size_t want = entries - i < 4096 ? entries - i : 4096;
+                memset(chunk, 0, sizeof(chunk));
+                readImage(img, chunk, want * sizeof(uint32_t), FATOffset + i * sizeof(uint32_t));
+            }
+            value = chunk[i % 4096];
+        }
+        hash = (hash ^ value) * 1099511628211ull;
+    }
+    return hash;
+}
+
+//<image>.idx, where the index of an image is kept unless told otherwise
+char *fat32__sidecarDefaultPath(struct Image *img)
+{
+    char *path = (char*) malloc(strlen(img->path) + 5);
+    sprintf(path, "%s.idx", img->path);
+    return path;
+}
+
+void fat32__sidecarUnload(struct Image *img)
+{
+    if(img->sidecar == NULL)
+    {
+        return;
+    }
+    munmap(img->sidecar->map, img->sidecar->size);
+    free(img->sidecar->path);
+    free(img->sidecar);
+    img->sidecar = NULL;
+}
+
+//True when a section of count items of size bytes lies inside the file
+static bool sidecarSectionFits(size_t fileSize, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset % 8 == 0 && offset <= fileSize && count <= (fileSize - offset) / size;
+}
+
+//Maps the index at path and checks it still describes the image.
+//Returns 0 when loaded, -1 when there is no index there and -2 when the
+//index is damaged or out of date.
+int fat32__sidecarLoad(struct Image *img, const char *path)
+{
+    struct stat imageStat;
+    struct stat indexStat;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+
+    if(fstat(fd, &indexStat) != 0 || fstat(img->fd, &imageStat) != 0
+       || (size_t)indexStat.st_size < sizeof(struct SidecarHeader))
+    {
+        close(fd);
+        return -2;
+    }
+
+    size_t size = indexStat.st_size;
+    unsigned char *map = (unsigned char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        return -2;
+    }
+
+    const struct SidecarHeader *header = (const struct SidecarHeader*) map;
+    bool valid = memcmp(header->magic, SIDECAR_MAGIC, 8) == 0
+        && header->version == SIDECAR_VERSION
+        && header->bytesPerCluster == img->BytesPerCluster
+        && header->imageSize == (uint64_t)imageStat.st_size
+        && header->imageMtime == (int64_t)imageStat.st_mtim.tv_sec
+        && header->imageMtimeNsec == (int64_t)imageStat.st_mtim.tv_nsec
+        && header->nodeCount > 0
+        && sidecarSectionFits(size, header->nodesOffset, header->nodeCount, sizeof(struct SidecarNode))
+        && sidecarSectionFits(size, header->keysOffset, header->keyCount, sizeof(struct SidecarKey))
+        && sidecarSectionFits(size, header->extentsOffset, header->extentCount, sizeof(struct Extent))
+        && sidecarSectionFits(size, header->namesOffset, header->nameBytes, 1)
+        && (header->nameBytes == 0 || map[header->namesOffset + header->nameBytes - 1] == '\0');
+
+    //Every key has to point at a node, sidecarFind trusts them
+    const struct SidecarKey *keys = (const struct SidecarKey*) (map + header->keysOffset);
+    for(uint32_t i = 0; valid && i < header->keyCount; i++)
+    {
+        valid = keys[i].node < header->nodeCount;
+    }
+
+    //The FAT is only hashed once the cheap checks pass
+    if(!valid || header->fatChecksum != fatChecksum(img))
+    {
+        munmap(map, size);
+        return -2;
+    }
+
+    struct Sidecar *sidecar = (struct Sidecar*) calloc(1, sizeof(struct Sidecar));
+    sidecar->map = map;
+    sidecar->size = size;
+    sidecar->path = strdup(path);
+    sidecar->header = header;
+    sidecar->nodes = (const struct SidecarNode*) (map + header->nodesOffset);
+    sidecar->keys = keys;
+    sidecar->extents = (const struct Extent*) (map + header->extentsOffset);
+    sidecar->names = (const char*) (map + header->namesOffset);
+
+    fat32__sidecarUnload(img);
+    img->sidecar = sidecar;
+    return 0;
+}
+
+//Walks the chain starting at cluster and merges runs where the next cluster
+//is cluster+1 into extents. Only the clusters needed to hold fileSize bytes
+//are visited, or the whole chain when fileSize is 0. Returns the number of
+//extents stored in *extents, which the caller frees.
+int fat32__buildExtents(struct Image *img, uint32_t cluster, uint32_t fileSize, struct Extent **extents)
+{
+    uint32_t clustersLeft = UINT32_MAX;
+    int count = 0;
+    int capacity = 16;
+    struct ChainWalk walk;
+    const struct SidecarNode *node = sidecarFind(img, cluster);
+
+    //The sidecar index already holds the extents of every file
+    if(node != NULL && node->entry.DIR_FileSize == fileSize
+       && (uint64_t)node->firstExtent + node->extentCount <= img->sidecar->header->extentCount)
+    {
+        *extents = (struct Extent*) malloc((node->extentCount + 1) * sizeof(struct Extent));
+        memcpy(*extents, &img->sidecar->extents[node->firstExtent], node->extentCount * sizeof(struct Extent));
+        return node->extentCount;
+    }
+
+    if(fileSize > 0)
+    {
+        clustersLeft = (fileSize + img->BytesPerCluster - 1) / img->BytesPerCluster;
+    }
+
+    *extents = (struct Extent*) malloc(capacity * sizeof(struct Extent));
+    chainStart(&walk, cluster);
+
+    while(clustersLeft > 0 && validCluster(cluster))
+    {
+        if(count > 0 && (*extents)[count - 1].cluster + (*extents)[count - 1].length == cluster)
+        {
+            (*extents)[count - 1].length++;
+        }
+        else
+        {
+            if(count == capacity)
+            {
+                capacity *= 2;
+                *extents = (struct Extent*) realloc(*extents, capacity * sizeof(struct Extent));
+            }
+            (*extents)[count].cluster = cluster;
+            (*extents)[count].length = 1;
+            count++;
+        }
+
+        //A looping chain ends where it comes around, the extents then
+        //fall short of the file
+        clustersLeft--;
+        if(clustersLeft > 0 && !chainNext(img, &walk, &cluster))
+        {
+            break;
+        }
+    }
+
+    return count;
+}
+
+//True when the extents hold at least fileSize bytes and, for an image file,
+//every cluster of them lies inside it; false when the chain ended before the
+//file did or the image was cut short
+static bool extentsCover(struct Image *img, struct Extent *extents, int extentCount, uint32_t fileSize)
+{
+    uint64_t imageBytes = img->size;
+    uint64_t bytes = 0;
+    struct stat st;
+    int e;
+
+    if(img->map == NULL && img->isRegular && fstat(img->fd, &st) == 0)
+    {
+        imageBytes = st.st_size;
+    }
+
+    for(e = 0; e < extentCount && bytes < fileSize; e++)
+    {
+        uint64_t extentBytes = (uint64_t)extents[e].length * img->BytesPerCluster;
+        uint64_t needed = fileSize - bytes < extentBytes ? fileSize - bytes : extentBytes;
+
+        if(imageBytes > 0 && (uint64_t)LBAToOffset(img, extents[e].cluster) + needed > imageBytes)
+        {
+            return false;
+        }
+        bytes = bytes + extentBytes;
+    }
+    return bytes >= fileSize;
+}
+
+//Writes all len bytes of buf to fd. Returns 0 on success.
+int fat32__writeAll(int fd, const unsigned char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        buf = buf + n;
+        len = len - n;
+    }
+    return 0;
+}
+
+//Copies len bytes at offset in the image to the current position of outFd
+//without passing them through user space, using copy_file_range and then
+//sendfile. Returns the bytes copied, which is short of len when the kernel
+//can't do the rest and the caller has to fall back to read/write.
+static size_t kernelCopy(struct Image *img, int outFd, long offset, size_t len)
+{
+    int inFd = img->fd;
+    loff_t inOffset = offset;
+    size_t copied = 0;
+
+    while(copied < len)
+    {
+        ssize_t n = copy_file_range(inFd, &inOffset, outFd, NULL, len - copied, 0);
+        if(n <= 0)
+        {
+            break;
+        }
+        copied = copied + n;
+    }
+
+    while(copied < len)
+    {
+        off_t sendOffset = offset + copied;
+        ssize_t n = sendfile(outFd, inFd, &sendOffset, len - copied);
+        if(n <= 0)
+        {
+            break;
+        }
+        copied = copied + n;
+    }
+
+    return copied;
+}
+
+static void releaseClusterIndex(struct Image *img, struct ClusterIndex *index)
+{
+    if(index == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&img->lock);
+    bool unused = --index->refs == 0;
+    pthread_mutex_unlock(&img->lock);
+
+    if(unused)
+    {
+        free(index->clusters);
+        free(index);
+    }
+}
+
+//Returns the cluster index of the file starting at cluster, building it
+//from the chain when it isn't cached. NULL for empty files. The caller
+//hands it back with releaseClusterIndex.
+static struct ClusterIndex *getClusterIndex(struct Image *img, uint32_t cluster, uint32_t fileSize)
+{
+    struct ClusterIndexSlot *slot = &img->clusterIndexCache[0];
+    int i;
+
+    if(!validCluster(cluster) || fileSize == 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&img->lock);
+    for(i = 0; i < CLUSTER_INDEX_SLOTS; i++)
+    {
+        struct ClusterIndex *cached = img->clusterIndexCache[i].index;
+        if(cached != NULL && cached->firstCluster == cluster)
+        {
+            cached->refs++;
+            img->clusterIndexCache[i].lastUsed = ++img->clusterIndexClock;
+            pthread_mutex_unlock(&img->lock);
+            return cached;
+        }
+    }
+    pthread_mutex_unlock(&img->lock);
+
+    //The chain is walked without the lock, the FAT never changes
+    uint32_t needed = (fileSize + img->BytesPerCluster - 1) / img->BytesPerCluster;
+    struct ClusterIndex *index = (struct ClusterIndex*) malloc(sizeof(struct ClusterIndex));
+    index->clusters = (uint32_t*) malloc(needed * sizeof(uint32_t));
+    index->firstCluster = cluster;
+    index->count = 0;
+    index->refs = 2;
+
+    //A looping chain is cut where it comes around, reads stop there
+    struct ChainWalk walk;
+    chainStart(&walk, cluster);
+    while(index->count < needed && validCluster(cluster))
+    {
+        index->clusters[index->count++] = cluster;
+        if(index->count < needed && !chainNext(img, &walk, &cluster))
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&img->lock);
+    for(i = 0; i < CLUSTER_INDEX_SLOTS; i++)
+    {
+        if(img->clusterIndexCache[i].lastUsed < slot->lastUsed)
+        {
+            slot = &img->clusterIndexCache[i];
+        }
+    }
+    struct ClusterIndex *evicted = slot->index;
+    slot->index = index;
+    slot->lastUsed = ++img->clusterIndexClock;
+    pthread_mutex_unlock(&img->lock);
+
+    releaseClusterIndex(img, evicted);
+    return index;
+}
+
+static void freeClusterIndexes(struct Image *img)
+{
+    int i;
+    for(i = 0; i < CLUSTER_INDEX_SLOTS; i++)
+    {
+        releaseClusterIndex(img, img->clusterIndexCache[i].index);
+        img->clusterIndexCache[i].index = NULL;
+        img->clusterIndexCache[i].lastUsed = 0;
+    }
+}
+
+//pread/pwrite until all len bytes are moved. Return 0 on success.
+static int preadAll(int fd, unsigned char *buf, size_t len, long offset)
+{
+    while(len > 0)
+    {
+        ssize_t n = pread(fd, buf, len, offset);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        buf = buf + n;
+        len = len - n;
+        offset = offset + n;
+    }
+    return 0;
+}
+
+static int pwriteAll(int fd, const unsigned char *buf, size_t len, long offset)
+{
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        buf = buf + n;
+        len = len - n;
+        offset = offset + n;
+    }
+    return 0;
+}
+
+// One read queued by the async engines: len bytes of the image at
+// imageOffset that belong at outOffset in the output file
+struct CopyJob
+{
+    long imageOffset;
+    long outOffset;
+    size_t len;
+};
+
+//Splits the first fileSize bytes covered by extents into jobs of at most
+//chunkSize bytes. Returns the number of jobs stored in *jobs.
+static int buildCopyJobs(struct Image *img, struct Extent *extents, int extentCount, uint32_t fileSize, size_t chunkSize, struct CopyJob **jobs)
+{
+    int count = 0;
+    int capacity = 16;
+    long outOffset = 0;
+    int e;
+
+    *jobs = (struct CopyJob*) malloc(capacity * sizeof(struct CopyJob));
+
+    for(e = 0; e < extentCount && outOffset < fileSize; e++)
+    {
+        long imageOffset = LBAToOffset(img, extents[e].cluster);
+        size_t extentBytes = (size_t)extents[e].length * img->BytesPerCluster;
+        if(extentBytes > fileSize - outOffset)
+        {
+            extentBytes = fileSize - outOffset;
+        }
+
+        while(extentBytes > 0)
+        {
+            size_t len = extentBytes < chunkSize ? extentBytes : chunkSize;
+
+            if(count == capacity)
+            {
+                capacity *= 2;
+                *jobs = (struct CopyJob*) realloc(*jobs, capacity * sizeof(struct CopyJob));
+            }
+            (*jobs)[count].imageOffset = imageOffset;
+            (*jobs)[count].outOffset = outOffset;
+            (*jobs)[count].len = len;
+            count++;
+
+            imageOffset = imageOffset + len;
+            outOffset = outOffset + len;
+            extentBytes = extentBytes - len;
+        }
+    }
+
+    return count;
+}
+
+// Minimal io_uring instance driven through the raw syscalls: the submission
+// and completion rings and the SQE array, all mapped from the ring fd
+struct Uring
+{
+    int fd;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned toSubmit;
+};
+
+static void uringFree(struct Uring *ring)
+{
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if(ring->cqRing != NULL && ring->cqRing != MAP_FAILED)
+    {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if(ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if(ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+}
+
+//Creates a ring with room for entries requests. Returns 0 on success, -1
+//when the kernel has no io_uring support.
+static int uringSetup(struct Uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        uringFree(ring);
+        return -1;
+    }
+
+    ring->sqTail = (unsigned*)((char*)ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned*)((char*)ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)((char*)ring->sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned*)((char*)ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned*)((char*)ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned*)((char*)ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+    return 0;
+}
+
+//Adds a read to the submission ring, it is handed to the kernel by the
+//next uringSubmitAndWait
+static void uringQueueRead(struct Uring *ring, int fd, void *buf, size_t len, long offset, uint64_t userData)
+{
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+//Submits the queued reads and waits until at least waitNr have completed
+static int uringSubmitAndWait(struct Uring *ring, unsigned waitNr)
+{
+    int ret = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(ret >= 0)
+    {
+        ring->toSubmit = ring->toSubmit - ret;
+    }
+    return ret;
+}
+
+//Takes the next completion off the ring. Returns false when there is none.
+static bool uringNextCompletion(struct Uring *ring, struct io_uring_cqe *cqe)
+{
+    unsigned head = *ring->cqHead;
+
+    if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    *cqe = ring->cqes[head & *ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// How many failed io_uring_enter calls uringExtract puts up with while it
+// waits for the reads still in flight after an error
+#define URING_WAIT_RETRIES 16
+
+//Copies the jobs with up to ioQueueDepth reads in flight on an io_uring.
+//Each completed buffer is written out while the other reads are still
+//pending, then its slot is refilled with the next job. Returns -1 if the
+//ring can't be created or a read fails.
+static int uringExtract(struct Image *img, struct CopyJob *jobs, int jobCount, int outFd)
+{
+    struct Uring ring;
+    int depth = img->ioQueueDepth < jobCount ? img->ioQueueDepth : jobCount;
+    int inFd = img->fd;
+    int nextJob = 0;
+    int inFlight = 0;
+    int status = 0;
+    int waitFailures = 0;
+    int slot;
+
+    if(depth <= 0)
+    {
+        return 0;
+    }
+
+    if(uringSetup(&ring, depth) != 0)
+    {
+        return -1;
+    }
+
+    unsigned char **buffers = (unsigned char**) calloc(depth, sizeof(unsigned char*));
+    int *slotJob = (int*) malloc(depth * sizeof(int));
+    size_t *slotDone = (size_t*) malloc(depth * sizeof(size_t));
+
+    for(slot = 0; slot < depth; slot++)
+    {
+        buffers[slot] = (unsigned char*) malloc(ASYNC_CHUNK_SIZE);
+        slotJob[slot] = nextJob;
+        slotDone[slot] = 0;
+        uringQueueRead(&ring, inFd, buffers[slot], jobs[nextJob].len, jobs[nextJob].imageOffset, slot);
+        nextJob++;
+        inFlight++;
+    }
+
+    while(inFlight > 0)
+    {
+        struct io_uring_cqe cqe;
+
+        //Reads the kernel already has still land in their buffers, so after
+        //an error nothing new is queued but the ones in flight are reaped
+        if(uringSubmitAndWait(&ring, 1) < 0 && errno != EINTR)
+        {
+            status = -1;
+            if(++waitFailures > URING_WAIT_RETRIES)
+            {
+                break;
+            }
+        }
+
+        while(uringNextCompletion(&ring, &cqe))
+        {
+            slot = (int) cqe.user_data;
+            struct CopyJob *job = &jobs[slotJob[slot]];
+            inFlight--;
+
+            if(cqe.res <= 0 || pwriteAll(outFd, buffers[slot], cqe.res, job->outOffset + slotDone[slot]) != 0)
+            {
+                status = -1;
+                continue;
+            }
+
+            //Short reads are resubmitted for the rest of the job
+            slotDone[slot] = slotDone[slot] + cqe.res;
+            if(status == 0 && slotDone[slot] < job->len)
+            {
+                uringQueueRead(&ring, inFd, buffers[slot], job->len - slotDone[slot], job->imageOffset + slotDone[slot], slot);
+                inFlight++;
+            }
+            else if(status == 0 && nextJob < jobCount)
+            {
+                slotJob[slot] = nextJob;
+                slotDone[slot] = 0;
+                uringQueueRead(&ring, inFd, buffers[slot], jobs[nextJob].len, jobs[nextJob].imageOffset, slot);
+                nextJob++;
+                inFlight++;
+            }
+        }
+    }
+
+    //If the ring stopped answering with reads still pending, the kernel may
+    //yet write into the buffers, so they are left allocated
+    uringFree(&ring);
+    if(inFlight == 0)
+    {
+        for(slot = 0; slot < depth; slot++)
+        {
+            free(buffers[slot]);
+        }
+        free(buffers);
+    }
+    free(slotJob);
+    free(slotDone);
+    return status;
+}
+
+// Shared state of the copy thread pool: workers claim jobs by index. With
+// zeroCopy each job is first offered to copy_file_range at its offsets.
+struct ThreadCopy
+{
+    struct CopyJob *jobs;
+    int jobCount;
+    int nextJob;
+    int inFd;
+    int outFd;
+    size_t bufferSize;
+    bool zeroCopy;
+    int status;
+};
+
+//Copies one job from inFd to outFd by offset, in the kernel when zeroCopy
+//is set and through buffer otherwise. Returns 0 on success.
+static int copyJob(struct CopyJob *job, int inFd, int outFd, unsigned char *buffer, size_t bufferSize, bool zeroCopy)
+{
+    loff_t inOffset = job->imageOffset;
+    loff_t outOffset = job->outOffset;
+    size_t left = job->len;
+
+    while(zeroCopy && left > 0)
+    {
+        ssize_t n = copy_file_range(inFd, &inOffset, outFd, &outOffset, left, 0);
+        if(n <= 0)
+        {
+            break;
+        }
+        left = left - n;
+    }
+
+    while(left > 0)
+    {
+        size_t len = left < bufferSize ? left : bufferSize;
+        if(preadAll(inFd, buffer, len, inOffset) != 0 ||
+           pwriteAll(outFd, buffer, len, outOffset) != 0)
+        {
+            return -1;
+        }
+        inOffset = inOffset + len;
+        outOffset = outOffset + len;
+        left = left - len;
+    }
+    return 0;
+}
+
+static void *copyWorker(void *arg)
+{
+    struct ThreadCopy *copy = (struct ThreadCopy*) arg;
+    unsigned char *buffer = (unsigned char*) malloc(copy->bufferSize);
+
+    while(1)
+    {
+        int j = __atomic_fetch_add(&copy->nextJob, 1, __ATOMIC_RELAXED);
+        if(j >= copy->jobCount)
+        {
+            break;
+        }
+
+        if(copyJob(&copy->jobs[j], copy->inFd, copy->outFd, buffer, copy->bufferSize, copy->zeroCopy) != 0)
+        {
+            __atomic_store_n(&copy->status, -1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+//Runs the jobs on up to workers threads. Returns -1 if any job failed.
+static int runCopyWorkers(struct Image *img, struct CopyJob *jobs, int jobCount, int outFd, int workers, size_t bufferSize, bool zeroCopy)
+{
+    struct ThreadCopy copy = { jobs, jobCount, 0, img->fd, outFd, bufferSize, zeroCopy, 0 };
+    pthread_t *threads;
+    int started = 0;
+    int t;
+
+    if(workers > jobCount)
+    {
+        workers = jobCount;
+    }
+    threads = (pthread_t*) malloc((workers > 0 ? workers : 1) * sizeof(pthread_t));
+
+    for(t = 0; t < workers; t++)
+    {
+        if(pthread_create(&threads[t], NULL, copyWorker, &copy) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    //If no thread could be started do the copy here
+    if(started == 0 && jobCount > 0)
+    {
+        copyWorker(&copy);
+    }
+
+    for(t = 0; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(threads);
+    return copy.status;
+}
+
+//Copies the jobs with ioQueueDepth threads, each doing pread then pwrite,
+//so that many reads are outstanding while others are being written.
+static int threadExtract(struct Image *img, struct CopyJob *jobs, int jobCount, int outFd)
+{
+    return runCopyWorkers(img, jobs, jobCount, outFd, img->ioQueueDepth, ASYNC_CHUNK_SIZE, false);
+}
+
+//Splits a file across workers threads for get -j. The output is
+//preallocated to its final size and every worker writes its own ranges
+//with pwrite, or copy_file_range when zerocopy is on.
+static int parallelExtract(struct Image *img, struct Extent *extents, int extentCount, uint32_t fileSize, int outFd, int workers)
+{
+    struct CopyJob *jobs;
+    size_t chunkSize = ((size_t)fileSize + workers - 1) / workers;
+    int status;
+
+    //At least one job per worker, but no job bigger than img->maxIOSize
+    if(chunkSize > img->maxIOSize)
+    {
+        chunkSize = img->maxIOSize;
+    }
+    if(chunkSize < img->BytesPerCluster)
+    {
+        chunkSize = img->BytesPerCluster;
+    }
+
+    if(fallocate(outFd, 0, 0, fileSize) != 0 && ftruncate(outFd, fileSize) != 0)
+    {
+        return -1;
+    }
+
+    int jobCount = buildCopyJobs(img, extents, extentCount, fileSize, chunkSize, &jobs);
+    status = runCopyWorkers(img, jobs, jobCount, outFd, workers, chunkSize, img->zeroCopy && img->isRegular);
+    free(jobs);
+    return status;
+}
+
+//Copies a file's first fileSize bytes with the engine picked at open.
+//io_uring falls back to the thread pool when the kernel doesn't support it.
+static int asyncExtract(struct Image *img, struct Extent *extents, int extentCount, uint32_t fileSize, int outFd)
+{
+    struct CopyJob *jobs;
+    size_t chunkSize = img->maxIOSize < ASYNC_CHUNK_SIZE ? img->maxIOSize : ASYNC_CHUNK_SIZE;
+    int jobCount = buildCopyJobs(img, extents, extentCount, fileSize, chunkSize, &jobs);
+    int status = -1;
+
+    if(img->ioEngine == IO_ENGINE_URING)
+    {
+        //The thread pool takes over if io_uring fails
+        status = uringExtract(img, jobs, jobCount, outFd);
+    }
+
+    if(status != 0)
+    {
+        status = threadExtract(img, jobs, jobCount, outFd);
+    }
+
+    free(jobs);
+    return status;
+}
+
+//Compares a name made by makeShortName with an entry's DIR_Name.
+//Both sides are loaded 16 bytes at a time; a directory entry is 32 bytes
+//and the short name buffer is 16, so the loads never run past either one.
+static inline bool shortNameEqual(const char *shortName, const char *dirName)
+{
+#ifdef __SSE2__
+    __m128i a = _mm_loadu_si128((const __m128i*) shortName);
+    __m128i b = _mm_loadu_si128((const __m128i*) dirName);
+    return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0x7ff) == 0x7ff;
+#else
+    return memcmp(shortName, dirName, 11) == 0;
+#endif
+}
+
+//Converts a name typed by the user into the 11-byte space padded upper
+//case form stored in DIR_Name. shortName must hold SHORT_NAME_BUFFER bytes
+//so it can be compared with shortNameEqual. Returns false when it can't be
+//an 8.3 name.
+static bool makeShortName(const char *user, char *shortName)
+{
+    const char *dot = strchr(user, '.');
+    size_t baseLength = dot ? (size_t)(dot - user) : strlen(user);
+    size_t extLength = dot ? strlen(dot + 1) : 0;
+    size_t i;
+
+    memset(shortName, ' ', 11);
+    memset(shortName + 11, 0, SHORT_NAME_BUFFER - 11);
+
+    if(strcmp(user, ".") == 0 || strcmp(user, "..") == 0)
+    {
+        memcpy(shortName, user, strlen(user));
+        return true;
+    }
+
+    if(baseLength == 0 || baseLength > 8 || extLength > 3 || (dot && strchr(dot + 1, '.')))
+    {
+        return false;
+    }
+
+    for(i = 0; i < baseLength; i++)
+    {
+        shortName[i] = toupper((unsigned char)user[i]);
+    }
+    for(i = 0; i < extLength; i++)
+    {
+        shortName[8 + i] = toupper((unsigned char)dot[1 + i]);
+    }
+    return true;
+}
+
+//FNV-1a hash of an 11-byte short name
+static uint32_t hashShortName(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for(i = 0; i < 11; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//Checksum of a short name that every long name piece in front of it carries
+static uint8_t shortNameChecksum(const char *name)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for(i = 0; i < 11; i++)
+    {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)name[i];
+    }
+    return sum;
+}
+
+// Collects the long name pieces met while scanning a directory until the
+// short entry they belong to turns up
+struct LongNameBuilder
+{
+    uint16_t chars[LONG_NAME_PIECES * LONG_NAME_CHARS];
+    uint8_t checksum;
+    int pieces;
+    int expected;
+};
+
+static void longNameReset(struct LongNameBuilder *builder)
+{
+    builder->pieces = 0;
+    builder->expected = 0;
+}
+
+static void longNameAdd(struct LongNameBuilder *builder, struct DirectoryEntry *entry)
+{
+    struct LongNameEntry *piece = (struct LongNameEntry*) entry;
+    int ord = piece->LDIR_Ord & ~LAST_LONG_ENTRY;
+
+    //The piece flagged as last comes first and tells how many follow
+    if(piece->LDIR_Ord & LAST_LONG_ENTRY)
+    {
+        if(ord < 1 || ord > LONG_NAME_PIECES)
+        {
+            longNameReset(builder);
+            return;
+        }
+        builder->pieces = ord;
+        builder->expected = ord;
+        builder->checksum = piece->LDIR_Chksum;
+    }
+    else if(builder->expected == 0 || ord != builder->expected || piece->LDIR_Chksum != builder->checksum)
+    {
+        longNameReset(builder);
+        return;
+    }
+
+    uint16_t *out = &builder->chars[(ord - 1) * LONG_NAME_CHARS];
+    memcpy(out, piece->LDIR_Name1, sizeof(piece->LDIR_Name1));
+    memcpy(out + 5, piece->LDIR_Name2, sizeof(piece->LDIR_Name2));
+    memcpy(out + 11, piece->LDIR_Name3, sizeof(piece->LDIR_Name3));
+    builder->expected--;
+}
+
+//Writes the UTF-8 form of a UCS-2 string of at most count characters into
+//out, stopping at a 0 or 0xFFFF pad. Unpaired surrogates become '?'.
+//Returns -1 when the name runs past LONG_NAME_UNITS or does not fit in size.
+static int ucs2ToUtf8(const uint16_t *in, int count, char *out, size_t size)
+{
+    char *end = out + size - 1;
+    int i;
+
+    for(i = 0; i < count && in[i] != 0 && in[i] != 0xffff; i++)
+    {
+        uint32_t c = in[i];
+
+        if(c >= 0xd800 && c <= 0xdbff && i + 1 < count && in[i + 1] >= 0xdc00 && in[i + 1] <= 0xdfff)
+        {
+            c = 0x10000 + ((c - 0xd800) << 10) + (in[++i] - 0xdc00);
+        }
+        else if(c >= 0xd800 && c <= 0xdfff)
+        {
+            c = '?';
+        }
+
+        if(i >= LONG_NAME_UNITS || end - out < (c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4))
+        {
+            *out = '\0';
+            return -1;
+        }
+
+        if(c < 0x80)
+        {
+            *out++ = c;
+        }
+        else if(c < 0x800)
+        {
+            *out++ = 0xc0 | (c >> 6);
+            *out++ = 0x80 | (c & 0x3f);
+        }
+        else if(c < 0x10000)
+        {
+            *out++ = 0xe0 | (c >> 12);
+            *out++ = 0x80 | ((c >> 6) & 0x3f);
+            *out++ = 0x80 | (c & 0x3f);
+        }
+        else
+        {
+            *out++ = 0xf0 | (c >> 18);
+            *out++ = 0x80 | ((c >> 12) & 0x3f);
+            *out++ = 0x80 | ((c >> 6) & 0x3f);
+            *out++ = 0x80 | (c & 0x3f);
+        }
+    }
+    *out = '\0';
+    return 0;
+}
+
+//Returns the long name that belongs to the short entry, or NULL when the
+//pieces before it are missing, out of order or carry the wrong checksum
+static char *longNameFinish(struct LongNameBuilder *builder, struct DirectoryEntry *entry)
+{
+    char name[LONG_NAME_MAX];
+    bool complete = builder->pieces > 0 && builder->expected == 0
+        && builder->checksum == shortNameChecksum(entry->DIR_Name);
+
+    if(!complete)
+    {
+        longNameReset(builder);
+        return NULL;
+    }
+
+    //A name filling its last piece exactly has no terminator, one running
+    //past 255 characters is not a valid long name
+    if(ucs2ToUtf8(builder->chars, LONG_NAME_CHARS * builder->pieces, name, sizeof(name)) < 0)
+    {
+        longNameReset(builder);
+        return NULL;
+    }
+    longNameReset(builder);
+    return name[0] ? strdup(name) : NULL;
+}
+
+//Case-insensitive FNV-1a hash of a long name, ASCII letters are folded
+static uint32_t hashLongName(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    for(; *name; name++)
+    {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hashDentry(uint32_t parent, const char *name)
+{
+    return (hashLongName(name) ^ parent) * 16777619u;
+}
+
+//Copies the cached entry for name in parent into found, 1 on a hit
+static int dentryLookup(struct Image *img, uint32_t parent, const char *name, struct DirectoryEntry *found)
+{
+    uint32_t hash = hashDentry(parent, name);
+    struct Dentry *dentry = &img->dentries[hash % DENTRY_CACHE_SLOTS];
+    int got = 0;
+
+    pthread_mutex_lock(&img->lock);
+    if(dentry->name != NULL && dentry->hash == hash && dentry->parent == parent && strcmp(dentry->name, name) == 0)
+    {
+        *found = dentry->entry;
+        got = 1;
+        img->dentryHits++;
+    }
+    else
+    {
+        img->dentryMisses++;
+    }
+    pthread_mutex_unlock(&img->lock);
+    return got;
+}
+
+static void dentryInsert(struct Image *img, uint32_t parent, const char *name, struct DirectoryEntry *entry)
+{
+    uint32_t hash = hashDentry(parent, name);
+    struct Dentry *dentry = &img->dentries[hash % DENTRY_CACHE_SLOTS];
+    char *copy = strdup(name);
+    char *old;
+
+    pthread_mutex_lock(&img->lock);
+    old = dentry->name;
+    dentry->parent = parent;
+    dentry->hash = hash;
+    dentry->name = copy;
+    dentry->entry = *entry;
+    pthread_mutex_unlock(&img->lock);
+
+    free(old);
+}
+
+//Forgets every cached path component
+void fat32__dentryClear(struct Image *img)
+{
+    int i;
+
+    pthread_mutex_lock(&img->lock);
+    for(i = 0; i < DENTRY_CACHE_SLOTS; i++)
+    {
+        if(img->dentries[i].name != NULL)
+        {
+            free(img->dentries[i].name);
+            img->dentries[i].name = NULL;
+        }
+    }
+    pthread_mutex_unlock(&img->lock);
+}
+
+void fat32__releaseDirIndex(struct Image *img, struct DirIndex *index)
+{
+    if(index == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&img->lock);
+    bool unused = --index->refs == 0;
+    pthread_mutex_unlock(&img->lock);
+
+    if(unused)
+    {
+        uint32_t i;
+        for(i = 0; i < index->count; i++)
+        {
+            free(index->longNames[i]);
+        }
+        free(index->longNames);
+        free(index->longBuckets);
+        free(index->longNext);
+        free(index->entries);
+        free(index->buckets);
+        free(index->next);
+        free(index);
+    }
+}
+
+//Fills the name hash chains of an index whose entries are loaded
+static struct DirIndex *hashDirIndex(struct DirIndex *index)
+{
+    uint32_t i;
+
+    index->bucketCount = index->count * 2 + 1;
+    index->buckets = (int32_t*) malloc(index->bucketCount * sizeof(int32_t));
+    index->next = (int32_t*) malloc((index->count + 1) * sizeof(int32_t));
+    index->longBuckets = (int32_t*) malloc(index->bucketCount * sizeof(int32_t));
+    index->longNext = (int32_t*) malloc((index->count + 1) * sizeof(int32_t));
+    memset(index->buckets, 0xff, index->bucketCount * sizeof(int32_t));
+    memset(index->longBuckets, 0xff, index->bucketCount * sizeof(int32_t));
+
+    //Insert back to front so the first of two equal names wins, as in a scan
+    for(i = index->count; i-- > 0;)
+    {
+        uint32_t bucket = hashShortName(index->entries[i].DIR_Name) % index->bucketCount;
+        index->next[i] = index->buckets[bucket];
+        index->buckets[bucket] = i;
+
+        if(index->longNames[i] != NULL)
+        {
+            bucket = hashLongName(index->longNames[i]) % index->bucketCount;
+            index->longNext[i] = index->longBuckets[bucket];
+            index->longBuckets[bucket] = i;
+        }
+    }
+
+    return index;
+}
+
+//Loads the entries of a directory from the sidecar index, if it has one
+static bool sidecarDirEntries(struct Image *img, uint32_t directory, struct DirIndex *index)
+{
+    const struct SidecarNode *node = sidecarFind(img, directory);
+    uint32_t i;
+
+    if(node == NULL || !(node->entry.DIR_Attr & ATTR_DIRECTORY)
+       || (uint64_t)node->firstChild + node->childCount > img->sidecar->header->nodeCount)
+    {
+        return false;
+    }
+
+    index->count = node->childCount;
+    index->entries = (struct DirectoryEntry*) malloc((index->count + 1) * sizeof(struct DirectoryEntry));
+    index->longNames = (char**) malloc((index->count + 1) * sizeof(char*));
+
+    for(i = 0; i < index->count; i++)
+    {
+        const struct SidecarNode *child = &img->sidecar->nodes[node->firstChild + i];
+
+        index->entries[i] = child->entry;
+        index->longNames[i] = NULL;
+        //Names longer than a long name can be are not trusted either
+        if(child->nameOffset != SIDECAR_NO_NAME && child->nameOffset < img->sidecar->header->nameBytes
+           && strnlen(img->sidecar->names + child->nameOffset, LONG_NAME_MAX) < LONG_NAME_MAX)
+        {
+            index->longNames[i] = strdup(img->sidecar->names + child->nameOffset);
+        }
+    }
+    return true;
+}
+
+//Reads every live entry of a directory and hashes it by name
+static struct DirIndex *buildDirIndex(struct Image *img, uint32_t directory)
+{
+    struct DirIndex *index = (struct DirIndex*) calloc(1, sizeof(struct DirIndex));
+    struct DirIterator it;
+    struct DirectoryEntry *entry;
+    struct LongNameBuilder builder;
+    uint32_t capacity = 64;
+
+    index->cluster = directory;
+    if(sidecarDirEntries(img, directory, index))
+    {
+        return hashDirIndex(index);
+    }
+
+    index->entries = (struct DirectoryEntry*) malloc(capacity * sizeof(struct DirectoryEntry));
+    index->longNames = (char**) malloc(capacity * sizeof(char*));
+    longNameReset(&builder);
+
+    dirOpen(&it, img, directory);
+    while((entry = dirNext(&it)) != NULL)
+    {
+        if((unsigned char)entry->DIR_Name[0] == 0xe5)
+        {
+            longNameReset(&builder);
+            continue;
+        }
+        if(entry->DIR_Attr == ATTR_LONG_NAME)
+        {
+            longNameAdd(&builder, entry);
+            continue;
+        }
+        if(index->count == capacity)
+        {
+            capacity *= 2;
+            index->entries = (struct DirectoryEntry*) realloc(index->entries, capacity * sizeof(struct DirectoryEntry));
+            index->longNames = (char**) realloc(index->longNames, capacity * sizeof(char*));
+        }
+        index->longNames[index->count] = longNameFinish(&builder, entry);
+        index->entries[index->count++] = *entry;
+    }
+    dirClose(&it);
+
+    return hashDirIndex(index);
+}
+
+//Returns the index of the directory starting at cluster, building and
+//caching it on the first visit. The caller hands it back with
+//fat32__releaseDirIndex.
+struct DirIndex *fat32__getDirIndex(struct Image *img, uint32_t directory)
+{
+    struct DirIndexSlot *slot = &img->dirIndexCache[0];
+    int i;
+
+    pthread_mutex_lock(&img->lock);
+    for(i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        struct DirIndex *cached = img->dirIndexCache[i].index;
+        if(cached != NULL && cached->cluster == directory)
+        {
+            cached->refs++;
+            img->dirIndexCache[i].lastUsed = ++img->dirIndexClock;
+            pthread_mutex_unlock(&img->lock);
+            return cached;
+        }
+    }
+    pthread_mutex_unlock(&img->lock);
+
+    struct DirIndex *index = buildDirIndex(img, directory);
+    index->refs = 2;
+
+    pthread_mutex_lock(&img->lock);
+    for(i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        if(img->dirIndexCache[i].lastUsed < slot->lastUsed)
+        {
+            slot = &img->dirIndexCache[i];
+        }
+    }
+    struct DirIndex *evicted = slot->index;
+    slot->index = index;
+    slot->lastUsed = ++img->dirIndexClock;
+    pthread_mutex_unlock(&img->lock);
+
+    fat32__releaseDirIndex(img, evicted);
+    return index;
+}
+
+void fat32__freeDirIndexes(struct Image *img)
+{
+    int i;
+    for(i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        fat32__releaseDirIndex(img, img->dirIndexCache[i].index);
+        img->dirIndexCache[i].index = NULL;
+        img->dirIndexCache[i].lastUsed = 0;
+    }
+}
+
+//Opens an image and parses its BPB. With useMmap the image is mapped and
+//served from memory. Returns NULL when the image can't be opened or the
+//engine is unknown. A zero or too small queue depth or transfer size is
+//replaced by its default.
+struct Image *fat32__imageOpen(const char *path, const struct fat32_options *options)
+{
+    struct fat32_options defaults;
+    fat32_default_options(&defaults);
+
+    if(options->engine != IO_ENGINE_SYNC && options->engine != IO_ENGINE_URING
+        && options->engine != IO_ENGINE_THREADS)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+
+    struct Image *img = (struct Image*) calloc(1, sizeof(struct Image));
+    img->fd = fd;
+    img->ioEngine = options->engine;
+    img->ioQueueDepth = options->queue_depth >= 1 ? options->queue_depth : defaults.queue_depth;
+    img->zeroCopy = options->zero_copy;
+    img->maxIOSize = options->max_io_size >= MIN_IO_SIZE ? options->max_io_size : defaults.max_io_size;
+    img->cache.capacity = 256;
+    img->cache.readahead = 4;
+    img->dentries = (struct Dentry*) calloc(DENTRY_CACHE_SLOTS, sizeof(struct Dentry));
+    img->path = strdup(path);
+    pthread_mutex_init(&img->lock, NULL);
+
+    //Without a mapping every read goes through pread
+    if (options->use_mmap)
+    {
+        mapImage(img);
+    }
+
+    struct stat imageStat;
+    img->isRegular = fstat(img->fd, &imageStat) == 0 && S_ISREG(imageStat.st_mode);
+
+    //Used FatSpec.pdf to gather the value for limitations  for position and bytes
+    readImage(img, &img->BPB_BytesPerSec, 2, 11);
+    readImage(img, &img->BPB_SecPerClus, 1, 13);
+    readImage(img, &img->BPB_RsvdSecCnt, 2, 14);
+    readImage(img, &img->BPB_NumFATS, 1, 16);
+    readImage(img, &img->BPB_FATSz32, 4, 36);
+    readImage(img, &img->BPB_RootClus, 4, 44);
+
+    img->BytesPerCluster = img->BPB_BytesPerSec * img->BPB_SecPerClus;
+
+    //Data clusters after the reserved sectors and the FATs, never more than
+    //FAT #1 has entries for
+    uint32_t totalSectors = 0;
+    uint32_t FATEntries = (size_t)img->BPB_FATSz32 * img->BPB_BytesPerSec / sizeof(uint32_t);
+    uint32_t firstDataSector = img->BPB_RsvdSecCnt + img->BPB_NumFATS * img->BPB_FATSz32;
+    readImage(img, &totalSectors, 4, 32);
+    if(img->BPB_SecPerClus > 0 && totalSectors > firstDataSector)
+    {
+        img->ClusterCount = (totalSectors - firstDataSector) / img->BPB_SecPerClus;
+    }
+    if(FATEntries < 2 || img->ClusterCount > FATEntries - 2)
+    {
+        img->ClusterCount = FATEntries > 2 ? FATEntries - 2 : 0;
+    }
+
+    //Nothing can be read from an image without a cluster size
+    if(img->BytesPerCluster == 0 || img->BPB_BytesPerSec % 512 != 0)
+    {
+        fat32__imageClose(img);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    //When the FAT can't be loaded, chain walks read it from the image
+    if(options->fat_cache)
+    {
+        fat32__loadFAT(img);
+    }
+
+    //A sidecar index left by 'index write' is picked up automatically
+    char *indexPath = fat32__sidecarDefaultPath(img);
+    img->sidecarStale = fat32__sidecarLoad(img, indexPath) == -2;
+    free(indexPath);
+
+    return img;
+}
+
+void fat32__imageClose(struct Image *img)
+{
+    fat32__sidecarUnload(img);
+    fat32__freeFAT(img);
+    freeClusterIndexes(img);
+    fat32__freeDirIndexes(img);
+    fat32__dentryClear(img);
+    free(img->dentries);
+    fat32__cacheClear(img);
+    unmapImage(img);
+    close(img->fd);
+    pthread_mutex_destroy(&img->lock);
+    free(img->path);
+    free(img);
+}
+
+//Looks a name up in the directory at the given cluster and copies its
+//entry into found. Returns 1 when the name exists, 0 otherwise.
+static int findEntry(struct Image *img, uint32_t directory, char *name, struct DirectoryEntry *found)
+{
+    char shortName[SHORT_NAME_BUFFER];
+    struct DirIndex *index = fat32__getDirIndex(img, directory);
+    int32_t i = -1;
+
+    if(makeShortName(name, shortName))
+    {
+        i = index->buckets[hashShortName(shortName) % index->bucketCount];
+        while(i >= 0 && !shortNameEqual(shortName, index->entries[i].DIR_Name))
+        {
+            i = index->next[i];
+        }
+    }
+
+    //Long names are matched without regard to case, like Windows does
+    if(i < 0)
+    {
+        i = index->longBuckets[hashLongName(name) % index->bucketCount];
+        while(i >= 0 && strcasecmp(name, index->longNames[i]) != 0)
+        {
+            i = index->longNext[i];
+        }
+    }
+
+    if(i >= 0)
+    {
+        *found = index->entries[i];
+    }
+
+    fat32__releaseDirIndex(img, index);
+    return i >= 0;
+}
+
+//Resolves a path such as /DIR1/SUB/DEEP.TXT or SUB/../INNER.TXT, absolute
+//or relative to directory, and copies the entry it names into found. The
+//root has no entry of its own, so one is made up for it. Returns 1 when
+//every component exists and all but the last are directories.
+int fat32__resolvePath(struct Image *img, uint32_t directory, const char *path, struct DirectoryEntry *found)
+{
+    struct DirectoryEntry entry;
+    char component[LONG_NAME_MAX];
+
+    memset(&entry, 0, sizeof(entry));
+    memset(entry.DIR_Name, ' ', 11);
+    entry.DIR_Name[0] = '/';
+    entry.DIR_Attr = ATTR_DIRECTORY;
+    entry.DIR_FirstClusterHigh = img->BPB_RootClus >> 16;
+    entry.DIR_FirstClusterLow = img->BPB_RootClus & 0xffff;
+
+    if(*path == '/')
+    {
+        directory = img->BPB_RootClus;
+    }
+    else if(directory != img->BPB_RootClus && !findEntry(img, directory, ".", &entry))
+    {
+        return 0;
+    }
+
+    while(*path)
+    {
+        size_t length = strcspn(path, "/");
+        const char *rest = path + length;
+
+        while(*rest == '/')
+        {
+            rest++;
+        }
+
+        if(length >= sizeof(component))
+        {
+            return 0;
+        }
+        memcpy(component, path, length);
+        component[length] = '\0';
+        path = rest;
+
+        //Empty components come from repeated slashes, . stays in place and
+        //the root is its own parent
+        if(length == 0 || strcmp(component, ".") == 0
+           || (strcmp(component, "..") == 0 && directory == img->BPB_RootClus))
+        {
+            continue;
+        }
+
+        if(!(entry.DIR_Attr & ATTR_DIRECTORY))
+        {
+            return 0;
+        }
+
+        if(!dentryLookup(img, directory, component, &entry))
+        {
+            if(!findEntry(img, directory, component, &entry))
+            {
+                return 0;
+            }
+            dentryInsert(img, directory, component, &entry);
+        }
+
+        //A .. leading back to the root has cluster 0 and no name of its own
+        if(fat32__firstCluster(&entry) == 0 && (entry.DIR_Attr & ATTR_DIRECTORY))
+        {
+            return fat32__resolvePath(img, img->BPB_RootClus, *path ? path : "/", found);
+        }
+        directory = fat32__dirCluster(img, &entry);
+    }
+
+    *found = entry;
+    return 1;
+}
+
+//Last component of a path, used to name files copied out of the image
+const char *fat32__pathBaseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+//Whether a name read from the image can be joined onto a host directory.
+//A crafted long name could hold a / or be . or .., which would place the
+//copy outside the directory it was meant for.
+static bool hostNameSafe(const char *name)
+{
+    return *name != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+static int compareSidecarKeys(const void *a, const void *b)
+{
+    const struct SidecarKey *x = (const struct SidecarKey*) a;
+    const struct SidecarKey *y = (const struct SidecarKey*) b;
+
+    if(x->cluster != y->cluster)
+    {
+        return x->cluster < y->cluster ? -1 : 1;
+    }
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+//Walks the whole tree from the image and writes it, with every file's
+//extents and the free space summary, as a sidecar index at path. The new
+//index is loaded once written. Returns 0 on success.
+int fat32__sidecarWrite(struct Image *img, const char *path)
+{
+    struct SidecarHeader header;
+    struct SidecarNode *nodes;
+    struct SidecarKey *keys;
+    struct Extent *extents;
+    char *names;
+    uint32_t nodeCapacity = 256;
+    uint32_t extentCapacity = 256;
+    uint32_t nameCapacity = 4096;
+    uint32_t keyCount = 0;
+    uint32_t i;
+    struct stat imageStat;
+
+    //Everything below has to come from the image, not an older index
+    fat32__sidecarUnload(img);
+    fat32__freeDirIndexes(img);
+
+    memset(&header, 0, sizeof(header));
+    nodes = (struct SidecarNode*) calloc(nodeCapacity, sizeof(struct SidecarNode));
+    extents = (struct Extent*) malloc(extentCapacity * sizeof(struct Extent));
+    names = (char*) malloc(nameCapacity);
+
+    //Clusters of directories already listed, so a looping tree ends
+    uint32_t FATEntries = (size_t)img->BPB_FATSz32 * img->BPB_BytesPerSec / sizeof(uint32_t);
+    unsigned char *seen = (unsigned char*) calloc(FATEntries / 8 + 1, 1);
+
+    memset(nodes[0].entry.DIR_Name, ' ', 11);
+    nodes[0].entry.DIR_Name[0] = '/';
+    nodes[0].entry.DIR_Attr = ATTR_DIRECTORY;
+    nodes[0].entry.DIR_FirstClusterHigh = img->BPB_RootClus >> 16;
+    nodes[0].entry.DIR_FirstClusterLow = img->BPB_RootClus & 0xffff;
+    nodes[0].nameOffset = SIDECAR_NO_NAME;
+    header.nodeCount = 1;
+
+    //Breadth first, so the children of each directory end up side by side
+    for(i = 0; i < header.nodeCount; i++)
+    {
+        struct SidecarNode *node = &nodes[i];
+        uint32_t cluster = i == 0 ? img->BPB_RootClus : fat32__firstCluster(&node->entry);
+        struct Extent *fileExtents;
+        int extentCount;
+        uint32_t c;
+
+        if(cluster == 0 || (i > 0 && node->entry.DIR_Name[0] == '.'))
+        {
+            continue;
+        }
+
+        extentCount = fat32__buildExtents(img, cluster, node->entry.DIR_FileSize, &fileExtents);
+        if(header.extentCount + extentCount > extentCapacity)
+        {
+            while(header.extentCount + extentCount > extentCapacity)
+            {
+                extentCapacity *= 2;
+            }
+            extents = (struct Extent*) realloc(extents, extentCapacity * sizeof(struct Extent));
+        }
+        memcpy(&extents[header.extentCount], fileExtents, extentCount * sizeof(struct Extent));
+        node->firstExtent = header.extentCount;
+        node->extentCount = extentCount;
+        header.extentCount += extentCount;
+        free(fileExtents);
+
+        if(!(node->entry.DIR_Attr & ATTR_DIRECTORY) || cluster >= FATEntries || (seen[cluster / 8] & (1 << (cluster % 8))))
+        {
+            continue;
+        }
+        seen[cluster / 8] |= 1 << (cluster % 8);
+
+        struct DirIndex *index = fat32__getDirIndex(img, cluster);
+        if(header.nodeCount + index->count > nodeCapacity)
+        {
+            while(header.nodeCount + index->count > nodeCapacity)
+            {
+                nodeCapacity *= 2;
+            }
+            nodes = (struct SidecarNode*) realloc(nodes, nodeCapacity * sizeof(struct SidecarNode));
+            node = &nodes[i];
+        }
+
+        node->firstChild = header.nodeCount;
+        node->childCount = index->count;
+        for(c = 0; c < index->count; c++)
+        {
+            struct SidecarNode *child = &nodes[header.nodeCount++];
+
+            memset(child, 0, sizeof(*child));
+            child->entry = index->entries[c];
+            child->parent = i;
+            child->nameOffset = SIDECAR_NO_NAME;
+
+            if(index->longNames[c] != NULL)
+            {
+                size_t length = strlen(index->longNames[c]) + 1;
+                while(header.nameBytes + length > nameCapacity)
+                {
+                    nameCapacity *= 2;
+                    names = (char*) realloc(names, nameCapacity);
+                }
+                memcpy(names + header.nameBytes, index->longNames[c], length);
+                child->nameOffset = header.nameBytes;
+                header.nameBytes += length;
+            }
+        }
+        fat32__releaseDirIndex(img, index);
+    }
+    free(seen);
+
+    keys = (struct SidecarKey*) malloc((header.nodeCount + 1) * sizeof(struct SidecarKey));
+    for(i = 0; i < header.nodeCount; i++)
+    {
+        uint32_t cluster = i == 0 ? img->BPB_RootClus : fat32__firstCluster(&nodes[i].entry);
+        if(cluster != 0 && (i == 0 || nodes[i].entry.DIR_Name[0] != '.'))
+        {
+            keys[keyCount].cluster = cluster;
+            keys[keyCount].node = i;
+            keyCount++;
+        }
+    }
+    qsort(keys, keyCount, sizeof(struct SidecarKey), compareSidecarKeys);
+
+    //Free space summary over every data cluster
+    uint32_t run = 0;
+    header.totalClusters = img->ClusterCount;
+    for(i = 2; i < header.totalClusters + 2; i++)
+    {
+        if(NextLB(img, i) == 0)
+        {
+            header.freeClusters++;
+            if(run++ == 0)
+            {
+                header.freeRuns++;
+            }
+            if(run > header.largestFreeRun)
+            {
+                header.largestFreeRun = run;
+            }
+        }
+        else
+        {
+            run = 0;
+        }
+    }
+
+    fstat(img->fd, &imageStat);
+    memcpy(header.magic, SIDECAR_MAGIC, 8);
+    header.version = SIDECAR_VERSION;
+    header.bytesPerCluster = img->BytesPerCluster;
+    header.imageSize = imageStat.st_size;
+    header.imageMtime = imageStat.st_mtim.tv_sec;
+    header.imageMtimeNsec = imageStat.st_mtim.tv_nsec;
+    header.fatChecksum = fatChecksum(img);
+    header.keyCount = keyCount;
+    header.nodesOffset = sizeof(header);
+    header.keysOffset = header.nodesOffset + ((uint64_t)header.nodeCount * sizeof(struct SidecarNode) + 7) / 8 * 8;
+    header.extentsOffset = header.keysOffset + (uint64_t)keyCount * sizeof(struct SidecarKey);
+    header.namesOffset = header.extentsOffset + (uint64_t)header.extentCount * sizeof(struct Extent);
+
+    //Written under a temporary name so a reader never maps half an index
+    char *tempPath = (char*) malloc(strlen(path) + 5);
+    sprintf(tempPath, "%s.tmp", path);
+    FILE *out = fopen(tempPath, "w");
+    int status = -1;
+    if(out != NULL)
+    {
+        static const char padding[8];
+        size_t nodeBytes = (size_t)header.nodeCount * sizeof(struct SidecarNode);
+
+        bool written = fwrite(&header, sizeof(header), 1, out) == 1
+            && fwrite(nodes, 1, nodeBytes, out) == nodeBytes
+            && fwrite(padding, 1, header.keysOffset - header.nodesOffset - nodeBytes, out) == header.keysOffset - header.nodesOffset - nodeBytes
+            && fwrite(keys, sizeof(struct SidecarKey), keyCount, out) == keyCount
+            && fwrite(extents, sizeof(struct Extent), header.extentCount, out) == header.extentCount
+            && fwrite(names, 1, header.nameBytes, out) == header.nameBytes;
+
+        if(fclose(out) == 0 && written && rename(tempPath, path) == 0)
+        {
+            status = 0;
+        }
+        else
+        {
+            unlink(tempPath);
+        }
+    }
+
+    free(tempPath);
+    free(nodes);
+    free(keys);
+    free(extents);
+    free(names);
+
+    if(status == 0 && fat32__sidecarLoad(img, path) != 0)
+    {
+        status = -1;
+    }
+    return status;
+}
+
+// Directories waiting to be listed by one walker thread. The owner pushes
+// and pops at the tail, idle threads steal the oldest task from the head.
+struct WalkDeque
+{
+    pthread_mutex_t lock;
+    struct WalkNode **tasks;
+    int head;
+    int tail;
+    int capacity;
+};
+
+struct Walker
+{
+    struct Image *img;
+    struct WalkDeque *deques;
+    int workers;
+    //Directories queued or being listed, the walk is over when it is 0
+    long pending;
+    //Threads without work sleep on idle until a directory is queued or
+    //the walk is over. queued counts the tasks sitting in the deques.
+    pthread_mutex_t idleLock;
+    pthread_cond_t idle;
+    long queued;
+    //Directory clusters already queued, so a looping tree ends
+    pthread_mutex_t seenLock;
+    unsigned char *seen;
+    uint32_t seenClusters;
+};
+
+struct WalkWorker
+{
+    struct Walker *walker;
+    int id;
+};
+
+//Queues node on the deque of thread id and wakes an idle thread to steal it
+static void walkPush(struct Walker *walker, int id, struct WalkNode *node)
+{
+    struct WalkDeque *deque = &walker->deques[id];
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail == deque->capacity)
+    {
+        //Slide the live tasks down before growing
+        memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(struct WalkNode*));
+        deque->tail -= deque->head;
+        deque->head = 0;
+        if(deque->tail * 2 > deque->capacity)
+        {
+            deque->capacity *= 2;
+            deque->tasks = (struct WalkNode**) realloc(deque->tasks, deque->capacity * sizeof(struct WalkNode*));
+        }
+    }
+    deque->tasks[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&walker->idleLock);
+    __atomic_add_fetch(&walker->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&walker->idle);
+    pthread_mutex_unlock(&walker->idleLock);
+}
+
+//Takes the newest task when owner is set, the oldest one otherwise
+static struct WalkNode *walkTake(struct WalkDeque *deque, bool owner)
+{
+    struct WalkNode *node = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->head < deque->tail)
+    {
+        node = owner ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+//Name shown for an entry: its long name, or NAME.EXT without the padding
+void fat32__entryDisplayName(struct DirectoryEntry *entry, const char *longName, char *out)
+{
+    int length = 8;
+    int ext = 3;
+
+    if(longName != NULL)
+    {
+        strcpy(out, longName);
+        return;
+    }
+
+    while(length > 0 && entry->DIR_Name[length - 1] == ' ')
+    {
+        length--;
+    }
+    while(ext > 0 && entry->DIR_Name[8 + ext - 1] == ' ')
+    {
+        ext--;
+    }
+
+    memcpy(out, entry->DIR_Name, length);
+    if(ext > 0)
+    {
+        out[length++] = '.';
+        memcpy(out + length, entry->DIR_Name + 8, ext);
+        length += ext;
+    }
+    out[length] = '\0';
+}
+
+//Lists one directory into node->children and queues its subdirectories
+static void walkDirectory(struct Walker *walker, int id, struct WalkNode *node)
+{
+    struct Image *img = walker->img;
+    struct DirIndex *index = fat32__getDirIndex(img, fat32__dirCluster(img, &node->entry));
+    char name[LONG_NAME_MAX];
+    uint32_t i;
+
+    node->children = (struct WalkNode*) calloc(index->count + 1, sizeof(struct WalkNode));
+    for(i = 0; i < index->count; i++)
+    {
+        struct DirectoryEntry *entry = &index->entries[i];
+
+        if(entry->DIR_Name[0] == '.' || (entry->DIR_Attr & ATTR_VOLUME_ID))
+        {
+            continue;
+        }
+
+        struct WalkNode *child = &node->children[node->childCount++];
+        child->entry = *entry;
+        fat32__entryDisplayName(entry, index->longNames[i], name);
+        child->name = strdup(name);
+    }
+    fat32__releaseDirIndex(img, index);
+
+    //Queued only after the children array stops moving
+    for(i = 0; i < node->childCount; i++)
+    {
+        struct WalkNode *child = &node->children[i];
+        uint32_t cluster = fat32__firstCluster(&child->entry);
+        bool fresh = false;
+
+        if(!(child->entry.DIR_Attr & ATTR_DIRECTORY) || !validCluster(cluster))
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&walker->seenLock);
+        if(cluster < walker->seenClusters && !(walker->seen[cluster / 8] & (1 << (cluster % 8))))
+        {
+            walker->seen[cluster / 8] |= 1 << (cluster % 8);
+            fresh = true;
+        }
+        pthread_mutex_unlock(&walker->seenLock);
+
+        if(fresh)
+        {
+            __atomic_add_fetch(&walker->pending, 1, __ATOMIC_SEQ_CST);
+            walkPush(walker, id, child);
+        }
+    }
+}
+
+static void *walkWorker(void *arg)
+{
+    struct WalkWorker *self = (struct WalkWorker*) arg;
+    struct Walker *walker = self->walker;
+
+    while(__atomic_load_n(&walker->pending, __ATOMIC_SEQ_CST) > 0)
+    {
+        struct WalkNode *node = walkTake(&walker->deques[self->id], true);
+        int victim;
+
+        //Out of work, take the oldest directory another thread has queued
+        for(victim = 1; node == NULL && victim < walker->workers; victim++)
+        {
+            node = walkTake(&walker->deques[(self->id + victim) % walker->workers], false);
+        }
+
+        //Nothing to steal either, sleep until walkPush queues a directory
+        //or the last one has been listed
+        if(node == NULL)
+        {
+            pthread_mutex_lock(&walker->idleLock);
+            while(__atomic_load_n(&walker->queued, __ATOMIC_SEQ_CST) == 0 &&
+                  __atomic_load_n(&walker->pending, __ATOMIC_SEQ_CST) > 0)
+            {
+                pthread_cond_wait(&walker->idle, &walker->idleLock);
+            }
+            pthread_mutex_unlock(&walker->idleLock);
+            continue;
+        }
+
+        __atomic_sub_fetch(&walker->queued, 1, __ATOMIC_SEQ_CST);
+        walkDirectory(walker, self->id, node);
+        if(__atomic_sub_fetch(&walker->pending, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            pthread_mutex_lock(&walker->idleLock);
+            pthread_cond_broadcast(&walker->idle);
+            pthread_mutex_unlock(&walker->idleLock);
+        }
+    }
+    return NULL;
+}
+
+//Lists the whole tree below the directory entry root using workers
+//threads, each subdirectory being a task of its own. Returns the root
+//node, which the caller frees with fat32__freeWalkTree.
+struct WalkNode *fat32__walkTree(struct Image *img, struct DirectoryEntry *root, const char *rootName, int workers)
+{
+    struct WalkNode *node = (struct WalkNode*) calloc(1, sizeof(struct WalkNode));
+    struct Walker walker;
+    pthread_t *threads = (pthread_t*) malloc(workers * sizeof(pthread_t));
+    struct WalkWorker *selves = (struct WalkWorker*) malloc(workers * sizeof(struct WalkWorker));
+    int started = 0;
+    int i;
+
+    node->entry = *root;
+    node->name = strdup(rootName);
+
+    memset(&walker, 0, sizeof(walker));
+    walker.img = img;
+    walker.workers = workers;
+    walker.deques = (struct WalkDeque*) calloc(workers, sizeof(struct WalkDeque));
+    walker.seenClusters = (size_t)img->BPB_FATSz32 * img->BPB_BytesPerSec / sizeof(uint32_t);
+    walker.seen = (unsigned char*) calloc(walker.seenClusters / 8 + 1, 1);
+    pthread_mutex_init(&walker.seenLock, NULL);
+    pthread_mutex_init(&walker.idleLock, NULL);
+    pthread_cond_init(&walker.idle, NULL);
+
+    for(i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+        walker.deques[i].capacity = 64;
+        walker.deques[i].tasks = (struct WalkNode**) malloc(64 * sizeof(struct WalkNode*));
+    }
+
+    uint32_t cluster = fat32__dirCluster(img, root);
+    if(cluster < walker.seenClusters)
+    {
+        walker.seen[cluster / 8] |= 1 << (cluster % 8);
+    }
+    walker.pending = 1;
+    walkPush(&walker, 0, node);
+
+    for(i = 0; i < workers; i++)
+    {
+        selves[i].walker = &walker;
+        selves[i].id = i;
+        if(pthread_create(&threads[i], NULL, walkWorker, &selves[i]) == 0)
+        {
+            started++;
+        }
+    }
+
+    //No thread could be started, walk on this one
+    if(started == 0)
+    {
+        walkWorker(&selves[0]);
+    }
+
+    for(i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for(i = 0; i < workers; i++)
+    {
+        pthread_mutex_destroy(&walker.deques[i].lock);
+        free(walker.deques[i].tasks);
+    }
+    pthread_mutex_destroy(&walker.seenLock);
+    pthread_mutex_destroy(&walker.idleLock);
+    pthread_cond_destroy(&walker.idle);
+    free(walker.deques);
+    free(walker.seen);
+    free(threads);
+    free(selves);
+    return node;
+}
+
+void fat32__freeWalkTree(struct WalkNode *node, bool top)
+{
+    uint32_t i;
+
+    for(i = 0; i < node->childCount; i++)
+    {
+        fat32__freeWalkTree(&node->children[i], false);
+    }
+    free(node->children);
+    free(node->name);
+    if(top)
+    {
+        free(node);
+    }
+}
+
+//Threads used by tree, du and find, one per online CPU
+int fat32__walkWorkers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1)
+    {
+        return 1;
+    }
+    return cpus > 64 ? 64 : cpus;
+}
+
+// get -r copies files smaller than this in batches, one task per batch,
+// and splits larger ones into chunks copied by several threads at once
+#define TREE_SPLIT_SIZE (4 * 1024 * 1024)
+#define TREE_BATCH_FILES 64
+#define TREE_BATCH_BYTES (4 * 1024 * 1024)
+
+struct TreeFile
+{
+    char *hostPath;
+    uint32_t cluster;
+    uint32_t size;
+    //Set when any piece of the file could not be read or written
+    int failed;
+};
+
+// A task of get -r: files[first] up to files[first + count - 1] copied
+// whole, or with chunk set the single piece job of the big file files[first]
+struct TreeTask
+{
+    uint32_t first;
+    uint32_t count;
+    bool chunk;
+    struct CopyJob job;
+};
+
+struct TreeCopy
+{
+    struct Image *img;
+    struct TreeFile *files;
+    struct TreeTask *tasks;
+    int taskCount;
+    int nextTask;
+    bool zeroCopy;
+};
+
+//Copies one small file whole into a new host file
+static int copyTreeFile(struct TreeCopy *copy, struct TreeFile *file, unsigned char *buffer)
+{
+    struct Extent *extents;
+    struct CopyJob *jobs;
+    int extentCount;
+    int jobCount;
+    int status = 0;
+    int j;
+
+    int outFd = open(file->hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(outFd < 0)
+    {
+        return -1;
+    }
+
+    extentCount = fat32__buildExtents(copy->img, file->cluster, file->size, &extents);
+    if(!extentsCover(copy->img, extents, extentCount, file->size))
+    {
+        status = -1;
+    }
+    jobCount = buildCopyJobs(copy->img, extents, extentCount, file->size, TREE_SPLIT_SIZE, &jobs);
+    for(j = 0; j < jobCount && status == 0; j++)
+    {
+        status = copyJob(&jobs[j], copy->img->fd, outFd, buffer, TREE_SPLIT_SIZE, copy->zeroCopy);
+    }
+
+    free(jobs);
+    free(extents);
+    if(close(outFd) != 0)
+    {
+        status = -1;
+    }
+    return status;
+}
+
+static void *treeCopyWorker(void *arg)
+{
+    struct TreeCopy *copy = (struct TreeCopy*) arg;
+    unsigned char *buffer = (unsigned char*) malloc(TREE_SPLIT_SIZE);
+
+    while(1)
+    {
+        int t = __atomic_fetch_add(&copy->nextTask, 1, __ATOMIC_RELAXED);
+        if(t >= copy->taskCount)
+        {
+            break;
+        }
+
+        struct TreeTask *task = &copy->tasks[t];
+        uint32_t f;
+
+        if(task->chunk)
+        {
+            //The file was created and sized before the pool started
+            int outFd = open(copy->files[task->first].hostPath, O_WRONLY);
+            if(outFd < 0 || copyJob(&task->job, copy->img->fd, outFd, buffer, TREE_SPLIT_SIZE, copy->zeroCopy) != 0)
+            {
+                __atomic_store_n(&copy->files[task->first].failed, 1, __ATOMIC_RELAXED);
+            }
+            if(outFd >= 0)
+            {
+                close(outFd);
+            }
+            continue;
+        }
+
+        for(f = task->first; f < task->first + task->count; f++)
+        {
+            if(copyTreeFile(copy, &copy->files[f], buffer) != 0)
+            {
+                copy->files[f].failed = 1;
+            }
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+//Makes the host directory for node and lists every file below it in files
+static int collectTree(struct WalkNode *node, const char *hostPath, struct TreeFile **files, uint32_t *count, uint32_t *capacity,
+                int *rejected)
+{
+    uint32_t i;
+
+    if(mkdir(hostPath, 0755) != 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    for(i = 0; i < node->childCount; i++)
+    {
+        struct WalkNode *child = &node->children[i];
+
+        //Entries whose names would escape hostPath are not copied
+        if(!hostNameSafe(child->name))
+        {
+            (*rejected)++;
+            continue;
+        }
+
+        char *childPath = (char*) malloc(strlen(hostPath) + strlen(child->name) + 2);
+        sprintf(childPath, "%s/%s", hostPath, child->name);
+
+        if(child->entry.DIR_Attr & ATTR_DIRECTORY)
+        {
+            int status = collectTree(child, childPath, files, count, capacity, rejected);
+            free(childPath);
+            if(status != 0)
+            {
+                return status;
+            }
+            continue;
+        }
+
+        if(*count == *capacity)
+        {
+            *capacity *= 2;
+            *files = (struct TreeFile*) realloc(*files, *capacity * sizeof(struct TreeFile));
+        }
+        (*files)[*count].hostPath = childPath;
+        (*files)[*count].cluster = fat32__firstCluster(&child->entry);
+        (*files)[*count].size = child->entry.DIR_FileSize;
+        (*files)[*count].failed = 0;
+        (*count)++;
+    }
+    return 0;
+}
+
+//get -r: recreates the directory tree below root with hostDir as its top
+//and copies every file into it on workers threads, filling stats. Returns
+//-1 when the host directories can't be created.
+int fat32__getTree(struct Image *img, struct DirectoryEntry *root, const char *rootName, const char *hostDir, int workers,
+            struct CopyStats *stats)
+{
+    struct timespec start;
+    struct timespec end;
+    uint32_t capacity = 256;
+    uint32_t count = 0;
+    struct TreeFile *files = (struct TreeFile*) malloc(capacity * sizeof(struct TreeFile));
+    struct TreeCopy copy;
+    unsigned long long totalBytes = 0;
+    int taskCapacity = 64;
+    uint32_t f;
+    int t;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct WalkNode *tree = fat32__walkTree(img, root, rootName, fat32__walkWorkers());
+    int rejected = 0;
+    int status = collectTree(tree, hostDir, &files, &count, &capacity, &rejected);
+    fat32__freeWalkTree(tree, true);
+
+    memset(&copy, 0, sizeof(copy));
+    copy.img = img;
+    copy.files = files;
+    copy.zeroCopy = img->zeroCopy && img->isRegular;
+    copy.tasks = (struct TreeTask*) malloc(taskCapacity * sizeof(struct TreeTask));
+
+    //Big files first, in chunks, so they start early and small batches
+    //fill in the gaps at the end
+    for(f = 0; f < count && status == 0; f++)
+    {
+        struct Extent *extents;
+        struct CopyJob *jobs;
+        int extentCount;
+        int jobCount;
+        int j;
+
+        if(files[f].size < TREE_SPLIT_SIZE)
+        {
+            continue;
+        }
+
+        int outFd = open(files[f].hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(outFd < 0 || ftruncate(outFd, files[f].size) != 0)
+        {
+            files[f].failed = 1;
+            if(outFd >= 0)
+            {
+                close(outFd);
+            }
+            continue;
+        }
+        close(outFd);
+
+        //A chain that ends before the file would leave its tail zeroed
+        extentCount = fat32__buildExtents(img, files[f].cluster, files[f].size, &extents);
+        if(!extentsCover(img, extents, extentCount, files[f].size))
+        {
+            files[f].failed = 1;
+            free(extents);
+            continue;
+        }
+        jobCount = buildCopyJobs(img, extents, extentCount, files[f].size, TREE_SPLIT_SIZE, &jobs);
+        for(j = 0; j < jobCount; j++)
+        {
+            if(copy.taskCount == taskCapacity)
+            {
+                taskCapacity *= 2;
+                copy.tasks = (struct TreeTask*) realloc(copy.tasks, taskCapacity * sizeof(struct TreeTask));
+            }
+            copy.tasks[copy.taskCount].first = f;
+            copy.tasks[copy.taskCount].count = 1;
+            copy.tasks[copy.taskCount].chunk = true;
+            copy.tasks[copy.taskCount].job = jobs[j];
+            copy.taskCount++;
+        }
+        free(jobs);
+        free(extents);
+    }
+
+    for(f = 0; f < count && status == 0;)
+    {
+        uint32_t batchBytes = 0;
+        uint32_t first = f;
+
+        if(files[f].size >= TREE_SPLIT_SIZE)
+        {
+            f++;
+            continue;
+        }
+
+        //Neighbouring small files, stopping at the next big one
+        while(f < count && files[f].size < TREE_SPLIT_SIZE && f - first < TREE_BATCH_FILES && batchBytes < TREE_BATCH_BYTES)
+        {
+            batchBytes += files[f].size;
+            f++;
+        }
+
+        if(copy.taskCount == taskCapacity)
+        {
+            taskCapacity *= 2;
+            copy.tasks = (struct TreeTask*) realloc(copy.tasks, taskCapacity * sizeof(struct TreeTask));
+        }
+        copy.tasks[copy.taskCount].first = first;
+        copy.tasks[copy.taskCount].count = f - first;
+        copy.tasks[copy.taskCount].chunk = false;
+        copy.taskCount++;
+    }
+
+    if(status == 0)
+    {
+        pthread_t *threads = (pthread_t*) malloc(workers * sizeof(pthread_t));
+        int started = 0;
+
+        for(t = 0; t < workers && t < copy.taskCount; t++)
+        {
+            if(pthread_create(&threads[t], NULL, treeCopyWorker, &copy) != 0)
+            {
+                break;
+            }
+            started++;
+        }
+
+        //If no thread could be started do the copy here
+        if(started == 0)
+        {
+            treeCopyWorker(&copy);
+        }
+
+        for(t = 0; t < started; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+        free(threads);
+
+        //Like mget, only files copied whole count as copied
+        int failed = 0;
+        for(f = 0; f < count; f++)
+        {
+            failed += files[f].failed;
+            totalBytes += files[f].failed ? 0 : files[f].size;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->files = count - failed;
+        stats->bytes = totalBytes;
+        stats->failures = failed + rejected;
+        stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+
+    for(f = 0; f < count; f++)
+    {
+        free(files[f].hostPath);
+    }
+    free(files);
+    free(copy.tasks);
+    return status;
+}
+
+#define MGET_QUEUE_DEPTH 16
+
+void fat32__pipeInit(struct PipeQueue *queue, int capacity)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->items = (void**) malloc(capacity * sizeof(void*));
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+}
+
+void fat32__pipeDestroy(struct PipeQueue *queue)
+{
+    free(queue->items);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_cond_destroy(&queue->notFull);
+}
+
+void fat32__pipePut(struct PipeQueue *queue, void *item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == queue->capacity)
+    {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count++) % queue->capacity] = item;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void *fat32__pipeGet(struct PipeQueue *queue)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == 0 && !queue->closed)
+    {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+    if(queue->count > 0)
+    {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+//No more puts, wakes every reader once the queue drains
+void fat32__pipeClose(struct PipeQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// A file matched by mget, with its chain once the resolver has walked it
+struct MgetFile
+{
+    char *hostPath;
+    struct DirectoryEntry entry;
+    struct Extent *extents;
+    int extentCount;
+};
+
+// A piece of file data read from the image, waiting for the writer
+struct MgetChunk
+{
+    struct MgetFile *file;
+    unsigned char *data;
+    size_t len;
+    bool first;
+    bool last;
+    // The image could not be read, the file is dropped instead of written
+    bool failed;
+};
+
+struct Mget
+{
+    struct Image *img;
+    struct MgetFile *files;
+    uint32_t count;
+    struct PipeQueue resolved;
+    struct PipeQueue chunks;
+    //File the writer has open
+    int outFd;
+    bool failed;
+    int failures;
+};
+
+//First stage: walks the cluster chain of each file into extents
+static void *mgetResolver(void *arg)
+{
+    struct Mget *mget = (struct Mget*) arg;
+    uint32_t f;
+
+    for(f = 0; f < mget->count; f++)
+    {
+        struct MgetFile *file = &mget->files[f];
+        file->extentCount = fat32__buildExtents(mget->img, fat32__firstCluster(&file->entry), file->entry.DIR_FileSize, &file->extents);
+        fat32__pipePut(&mget->resolved, file);
+    }
+    fat32__pipeClose(&mget->resolved);
+    return NULL;
+}
+
+//Writes one chunk, opening its file on the first and closing it on the
+//last. A file that failed anywhere is removed rather than left partial.
+static void mgetWriteChunk(struct Mget *mget, struct MgetChunk *chunk)
+{
+    if(chunk->first)
+    {
+        mget->outFd = open(chunk->file->hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        mget->failed = mget->outFd < 0;
+    }
+    if(chunk->failed)
+    {
+        mget->failed = true;
+    }
+    if(!mget->failed && chunk->len > 0 && fat32__writeAll(mget->outFd, chunk->data, chunk->len) != 0)
+    {
+        mget->failed = true;
+    }
+    if(chunk->last)
+    {
+        if(mget->outFd >= 0 && close(mget->outFd) != 0)
+        {
+            mget->failed = true;
+        }
+        if(mget->failed)
+        {
+            if(mget->outFd >= 0)
+            {
+                unlink(chunk->file->hostPath);
+            }
+            mget->failures++;
+        }
+        mget->outFd = -1;
+    }
+    free(chunk->data);
+    free(chunk);
+}
+
+//Last stage: opens, writes and closes the host files in the background
+static void *mgetWriter(void *arg)
+{
+    struct Mget *mget = (struct Mget*) arg;
+    struct MgetChunk *chunk;
+
+    while((chunk = (struct MgetChunk*) fat32__pipeGet(&mget->chunks)) != NULL)
+    {
+        mgetWriteChunk(mget, chunk);
+    }
+    return NULL;
+}
+
+//fat32__mget: copies every file of one directory whose name matches
+//pattern into hostDir. The chain walks, the image reads and the host
+//writes of different files overlap, each stage running on its own thread.
+//Returns -1 when hostDir can't be created and -2 when nothing matches.
+int fat32__mget(struct Image *img, uint32_t directory, const char *pattern, const char *hostDir, struct CopyStats *stats)
+{
+    struct timespec start;
+    struct timespec end;
+    struct Mget state;
+    struct DirIndex *index = fat32__getDirIndex(img, directory);
+    char name[LONG_NAME_MAX];
+    char shortName[LONG_NAME_MAX];
+    unsigned long long totalBytes = 0;
+    pthread_t resolver;
+    pthread_t writer;
+    struct MgetFile *file;
+    int rejected = 0;
+    uint32_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    //The pattern is matched once against the directory index
+    memset(&state, 0, sizeof(state));
+    state.img = img;
+    state.files = (struct MgetFile*) calloc(index->count + 1, sizeof(struct MgetFile));
+    for(i = 0; i < index->count; i++)
+    {
+        struct DirectoryEntry *entry = &index->entries[i];
+
+        if(entry->DIR_Name[0] == '.' || (entry->DIR_Attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID)))
+        {
+            continue;
+        }
+
+        fat32__entryDisplayName(entry, index->longNames[i], name);
+        fat32__entryDisplayName(entry, NULL, shortName);
+        if(fnmatch(pattern, name, FNM_CASEFOLD) != 0 && fnmatch(pattern, shortName, FNM_CASEFOLD) != 0)
+        {
+            continue;
+        }
+
+        //A match whose name would escape hostDir is counted but not copied
+        if(!hostNameSafe(name))
+        {
+            rejected++;
+            continue;
+        }
+
+        file = &state.files[state.count++];
+        file->entry = *entry;
+        file->hostPath = (char*) malloc(strlen(hostDir) + strlen(name) + 2);
+        sprintf(file->hostPath, "%s/%s", hostDir, name);
+    }
+    fat32__releaseDirIndex(img, index);
+
+    if(state.count == 0 || (mkdir(hostDir, 0755) != 0 && errno != EEXIST))
+    {
+        int status = state.count > 0 ? -1 : rejected > 0 ? 0 : -2;
+
+        memset(stats, 0, sizeof(*stats));
+        stats->failures = rejected;
+        for(i = 0; i < state.count; i++)
+        {
+            free(state.files[i].hostPath);
+        }
+        free(state.files);
+        return status;
+    }
+
+    fat32__pipeInit(&state.chunks, MGET_QUEUE_DEPTH);
+    state.outFd = -1;
+
+    bool resolverStarted = false;
+    bool writerStarted = pthread_create(&writer, NULL, mgetWriter, &state) == 0;
+    fat32__pipeInit(&state.resolved, MGET_QUEUE_DEPTH);
+    if(writerStarted && pthread_create(&resolver, NULL, mgetResolver, &state) == 0)
+    {
+        resolverStarted = true;
+    }
+    else
+    {
+        //Resolve everything up front when there is no thread to do it
+        fat32__pipeDestroy(&state.resolved);
+        fat32__pipeInit(&state.resolved, state.count + 1);
+        mgetResolver(&state);
+    }
+
+    //Middle stage on this thread: reads each resolved file a chunk at a time
+    while((file = (struct MgetFile*) fat32__pipeGet(&state.resolved)) != NULL)
+    {
+        uint32_t left = file->entry.DIR_FileSize;
+        size_t extentLeft = 0;
+        long offset = 0;
+        bool first = true;
+        bool last = false;
+        int e = 0;
+
+        do
+        {
+            while(extentLeft == 0 && e < file->extentCount)
+            {
+                offset = LBAToOffset(img, file->extents[e].cluster);
+                extentLeft = (size_t)file->extents[e].length * img->BytesPerCluster;
+                e++;
+            }
+
+            //An empty file still gets one chunk, to create it
+            struct MgetChunk *chunk = (struct MgetChunk*) malloc(sizeof(struct MgetChunk));
+            chunk->file = file;
+            chunk->len = left < extentLeft ? left : extentLeft;
+            if(chunk->len > ASYNC_CHUNK_SIZE)
+            {
+                chunk->len = ASYNC_CHUNK_SIZE;
+            }
+            chunk->data = (unsigned char*) malloc(chunk->len ? chunk->len : 1);
+            chunk->first = first;
+            first = false;
+
+            //A failed read or a chain shorter than the file ends the file
+            //here, the writer drops what it has of it
+            chunk->failed = (chunk->len == 0 && left > 0)
+                            || (chunk->len > 0 && readImage(img, chunk->data, chunk->len, offset) != chunk->len);
+            if(chunk->failed)
+            {
+                chunk->len = 0;
+            }
+
+            offset += chunk->len;
+            extentLeft -= chunk->len;
+            left -= chunk->len;
+            totalBytes += chunk->len;
+            last = left == 0 || chunk->failed;
+            chunk->last = last;
+
+            if(writerStarted)
+            {
+                fat32__pipePut(&state.chunks, chunk);
+            }
+            else
+            {
+                mgetWriteChunk(&state, chunk);
+            }
+        } while(!last);
+    }
+    fat32__pipeClose(&state.chunks);
+
+    if(resolverStarted)
+    {
+        pthread_join(resolver, NULL);
+    }
+    if(writerStarted)
+    {
+        pthread_join(writer, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->files = state.count - state.failures;
+    stats->bytes = totalBytes;
+    stats->failures = state.failures + rejected;
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for(i = 0; i < state.count; i++)
+    {
+        free(state.files[i].hostPath);
+        free(state.files[i].extents);
+    }
+    free(state.files);
+    fat32__pipeDestroy(&state.resolved);
+    fat32__pipeDestroy(&state.chunks);
+    return 0;
+}
+
+//Writes count bytes of a file starting at position to outFd, an extent at
+//a time. The kernel moves what it can, the rest goes through img->maxIOSize
+//pieces straight from the mapping or a buffer. Returns 0 on success and
+//-1 when outFd can't be written, or with errno set to EIO when the image
+//holds less of the file than its size.
+int fat32__streamFile(struct Image *img, struct DirectoryEntry *entry, uint32_t position, uint32_t count, int outFd)
+{
+    struct Extent *extents;
+    int extentCount = fat32__buildExtents(img, fat32__firstCluster(entry), entry->DIR_FileSize, &extents);
+    size_t bufferSize = img->maxIOSize < count ? img->maxIOSize : count;
+    unsigned char *buffer = NULL;
+    uint64_t extentStart = 0;
+    uint64_t end = (uint64_t)position + count;
+    int status = 0;
+    int e;
+
+    if(end > entry->DIR_FileSize)
+    {
+        end = entry->DIR_FileSize;
+    }
+
+    //Nothing is written when the chain ends before the requested range
+    if(!extentsCover(img, extents, extentCount, end))
+    {
+        errno = EIO;
+        status = -1;
+    }
+
+    for(e = 0; e < extentCount && extentStart < end && status == 0; e++)
+    {
+        uint64_t extentBytes = (uint64_t)extents[e].length * img->BytesPerCluster;
+        uint64_t from = position > extentStart ? position : extentStart;
+        uint64_t to = extentStart + extentBytes < end ? extentStart + extentBytes : end;
+
+        if(from < to)
+        {
+            long offset = LBAToOffset(img, extents[e].cluster) + (from - extentStart);
+            size_t left = to - from;
+
+            if(img->zeroCopy && img->isRegular)
+            {
+                size_t copied = kernelCopy(img, outFd, offset, left);
+                offset = offset + copied;
+                left = left - copied;
+            }
+
+            while(left > 0 && status == 0)
+            {
+                size_t blockBytes = left < bufferSize ? left : bufferSize;
+                const unsigned char *src = (const unsigned char*) imagePtr(img, offset, blockBytes);
+
+                if(src == NULL)
+                {
+                    if(buffer == NULL)
+                    {
+                        buffer = (unsigned char*) malloc(bufferSize);
+                    }
+                    if(readImage(img, buffer, blockBytes, offset) != blockBytes)
+                    {
+                        errno = EIO;
+                        status = -1;
+                        break;
+                    }
+                    src = buffer;
+                }
+                status = fat32__writeAll(outFd, src, blockBytes);
+
+                offset = offset + blockBytes;
+                left = left - blockBytes;
+            }
+        }
+        extentStart = extentStart + extentBytes;
+    }
+
+    free(buffer);
+    free(extents);
+    return status;
+}
+
+
+//Reads up to count bytes of a file starting at position into buf, a
+//cluster at a time. Returns how many bytes were read, which is less than
+//count at the end of the file or where the image can't be read.
+uint32_t fat32__preadEntry(struct Image *img, struct DirectoryEntry *entry, unsigned char *buf, uint32_t count, uint32_t position)
+{
+    //Reads never go past the end of the file
+    uint32_t fileSize = entry->DIR_FileSize;
+    uint32_t bytesRemainingToRead = count;
+
+    if(position >= fileSize)
+    {
+        return 0;
+    }
+    if(bytesRemainingToRead > fileSize - position)
+    {
+        bytesRemainingToRead = fileSize - position;
+    }
+
+    //The file's cluster index gives the cluster holding the requested
+    //offset directly instead of walking the chain to it
+    struct ClusterIndex *index = getClusterIndex(img, fat32__firstCluster(entry), fileSize);
+    uint32_t clusterNumber = position / img->BytesPerCluster;
+
+    //The first block starts part way into its cluster, the rest are
+    //read a whole cluster at a time
+    uint32_t byteOffset = position % img->BytesPerCluster;
+    unsigned char *buffer = (unsigned char*) malloc(img->BytesPerCluster);
+    uint32_t dataBytes = 0;
+
+    while(bytesRemainingToRead > 0 && index != NULL && clusterNumber < index->count)
+    {
+        uint32_t cluster = index->clusters[clusterNumber];
+        uint32_t blockBytes = img->BytesPerCluster - byteOffset;
+        if(blockBytes > bytesRemainingToRead)
+        {
+            blockBytes = bytesRemainingToRead;
+        }
+
+        uint32_t got;
+        const unsigned char *src = readCluster(img, buffer, cluster, byteOffset, blockBytes, &got);
+        memcpy(buf + dataBytes, src, got);
+        dataBytes = dataBytes + got;
+        if(got < blockBytes)
+        {
+            break;
+        }
+
+        bytesRemainingToRead = bytesRemainingToRead - blockBytes;
+        byteOffset = 0;
+        clusterNumber++;
+    }
+
+    free(buffer);
+    releaseClusterIndex(img, index);
+    return dataBytes;
+}
+
+//Copies a whole file to outFd, with workers threads or the image's I/O
+//engine. Returns 0 on success and -1 when outFd can't be written, or with
+//errno set to EIO when the image holds less of the file than its size.
+int fat32__extractEntry(struct Image *img, struct DirectoryEntry *entry, int outFd, int workers)
+{
+   //Handling sections of file
+    uint32_t byteremainingtoread = entry->DIR_FileSize;
+    struct Extent *extents;
+    int extentCount = fat32__buildExtents(img, fat32__firstCluster(entry), byteremainingtoread, &extents);
+
+    size_t bufferSize = img->maxIOSize < byteremainingtoread ? img->maxIOSize : byteremainingtoread;
+    unsigned char *buffer = (unsigned char*) malloc(bufferSize ? bufferSize : 1);
+    const unsigned char *src;
+    int status = 0;
+    int e;
+
+    //A chain that ends early would leave the end of the copy missing
+    if(!extentsCover(img, extents, extentCount, byteremainingtoread))
+    {
+        errno = EIO;
+        status = -1;
+        byteremainingtoread = 0;
+    }
+
+    //The parallel and async copies write by offset, if they fail the
+    //synchronous loop below rewrites the whole file from the start
+    else if(workers > 1)
+    {
+        if(parallelExtract(img, extents, extentCount, byteremainingtoread, outFd, workers) == 0)
+        {
+            byteremainingtoread = 0;
+        }
+    }
+    else if(img->ioEngine != IO_ENGINE_SYNC && asyncExtract(img, extents, extentCount, byteremainingtoread, outFd) == 0)
+    {
+        byteremainingtoread = 0;
+    }
+
+    //Each extent is moved with as few reads and writes as maxIOSize allows
+    for(e = 0; e < extentCount && byteremainingtoread > 0; e++)
+    {
+        long offset = LBAToOffset(img, extents[e].cluster);
+        size_t extentBytes = (size_t)extents[e].length * img->BytesPerCluster;
+        if(extentBytes > byteremainingtoread)
+        {
+            extentBytes = byteremainingtoread;
+        }
+
+        //Let the kernel move the extent, whatever it can't copy
+        //goes through the buffer below
+        if(img->zeroCopy && img->isRegular)
+        {
+            size_t copied = kernelCopy(img, outFd, offset, extentBytes);
+            offset = offset + copied;
+            extentBytes = extentBytes - copied;
+            byteremainingtoread = byteremainingtoread - copied;
+        }
+
+        while(extentBytes > 0)
+        {
+            size_t blockBytes = extentBytes < bufferSize ? extentBytes : bufferSize;
+
+            if((src = (const unsigned char*) imagePtr(img, offset, blockBytes)) == NULL)
+            {
+                if(readImage(img, buffer, blockBytes, offset) != blockBytes)
+                {
+                    errno = EIO;
+                    status = -1;
+                    byteremainingtoread = 0;
+                    break;
+                }
+                src = buffer;
+            }
+            if(fat32__writeAll(outFd, src, blockBytes) != 0)
+            {
+                status = -1;
+                byteremainingtoread = 0;
+                break;
+            }
+
+            offset = offset + blockBytes;
+            extentBytes = extentBytes - blockBytes;
+            byteremainingtoread = byteremainingtoread - blockBytes;
+        }
+    }
+
+    free(buffer);
+    free(extents);
+    return status;
+}
+
+// An open fat32_readdir listing: the directory's index, held until
+// fat32_closedir, and the next entry to return
+struct fat32_dir
+{
+    fat32_t *fs;
+    struct DirIndex *index;
+    uint32_t next;
+};
+
+//Fills a public stat from an entry and the name it is listed under
+static void fillStat(struct DirectoryEntry *entry, const char *longName, struct fat32_stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    fat32__entryDisplayName(entry, longName, st->name);
+    st->attr = entry->DIR_Attr;
+    st->size = entry->DIR_FileSize;
+    st->cluster = fat32__firstCluster(entry);
+}
+
+//Resolves a path from the root, setting errno when it doesn't exist
+static int lookupPath(fat32_t *fs, const char *path, struct DirectoryEntry *entry)
+{
+    if(fs == NULL || path == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(!fat32__resolvePath(fs, fs->BPB_RootClus, path, entry))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+void fat32_default_options(struct fat32_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->use_mmap = false;
+    options->engine = FAT32_ENGINE_SYNC;
+    options->queue_depth = 32;
+    options->fat_cache = true;
+    options->zero_copy = true;
+    options->max_io_size = 8 * 1024 * 1024;
+}
+
+fat32_t *fat32_open(const char *path, const struct fat32_options *options)
+{
+    struct fat32_options defaults;
+
+    if(options == NULL)
+    {
+        fat32_default_options(&defaults);
+        options = &defaults;
+    }
+    return fat32__imageOpen(path, options);
+}
+
+void fat32_close(fat32_t *fs)
+{
+    if(fs != NULL)
+    {
+        fat32__imageClose(fs);
+    }
+}
+
+int fat32_stat(fat32_t *fs, const char *path, struct fat32_stat *st)
+{
+    struct DirectoryEntry entry;
+    struct DirectoryEntry parent;
+    const char *longName = NULL;
+    struct DirIndex *index = NULL;
+    uint32_t i;
+
+    if(lookupPath(fs, path, &entry) != 0)
+    {
+        return -1;
+    }
+
+    //The long name lives in the parent directory, next to the entry
+    const char *base = fat32__pathBaseName(path);
+    if(*base != '\0' && strcmp(base, ".") != 0 && strcmp(base, "..") != 0)
+    {
+        char *parentPath = strndup(path, base - path);
+        if(fat32__resolvePath(fs, fs->BPB_RootClus, *parentPath ? parentPath : "/", &parent))
+        {
+            index = fat32__getDirIndex(fs, fat32__dirCluster(fs, &parent));
+            for(i = 0; i < index->count; i++)
+            {
+                if(memcmp(index->entries[i].DIR_Name, entry.DIR_Name, 11) == 0)
+                {
+                    longName = index->longNames[i];
+                    break;
+                }
+            }
+        }
+        free(parentPath);
+    }
+
+    fillStat(&entry, longName, st);
+    if(index != NULL)
+    {
+        fat32__releaseDirIndex(fs, index);
+    }
+
+    //The extent count shows how fragmented the file is
+    struct Extent *extents;
+    st->extents = fat32__buildExtents(fs, st->cluster, entry.DIR_FileSize, &extents);
+    free(extents);
+    return 0;
+}
+
+fat32_dir_t *fat32_opendir(fat32_t *fs, const char *path)
+{
+    struct DirectoryEntry entry;
+
+    if(lookupPath(fs, path, &entry) != 0)
+    {
+        return NULL;
+    }
+    if(!(entry.DIR_Attr & ATTR_DIRECTORY))
+    {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    fat32_dir_t *dir = (fat32_dir_t*) malloc(sizeof(fat32_dir_t));
+    dir->fs = fs;
+    dir->index = fat32__getDirIndex(fs, fat32__dirCluster(fs, &entry));
+    dir->next = 0;
+    return dir;
+}
+
+int fat32_readdir(fat32_dir_t *dir, struct fat32_stat *st)
+{
+    //. and .. and the volume label aren't files
+    while(dir->next < dir->index->count)
+    {
+        uint32_t i = dir->next++;
+        struct DirectoryEntry *entry = &dir->index->entries[i];
+
+        if(entry->DIR_Name[0] == '.' || (entry->DIR_Attr & ATTR_VOLUME_ID))
+        {
+            continue;
+        }
+        fillStat(entry, dir->index->longNames[i], st);
+        return 1;
+    }
+    return 0;
+}
+
+void fat32_closedir(fat32_dir_t *dir)
+{
+    if(dir != NULL)
+    {
+        fat32__releaseDirIndex(dir->fs, dir->index);
+        free(dir);
+    }
+}
+
+ssize_t fat32_pread(fat32_t *fs, const char *path, void *buf, size_t count, uint64_t offset)
+{
+    struct DirectoryEntry entry;
+
+    if(lookupPath(fs, path, &entry) != 0)
+    {
+        return -1;
+    }
+    if(entry.DIR_Attr & ATTR_DIRECTORY)
+    {
+        errno = EISDIR;
+        return -1;
+    }
+
+    //Files end below 4 GB, so nothing past that can be read
+    if(offset >= entry.DIR_FileSize)
+    {
+        return 0;
+    }
+    if(count > entry.DIR_FileSize)
+    {
+        count = entry.DIR_FileSize;
+    }
+    //Nothing read inside the file means the image itself failed
+    uint32_t got = fat32__preadEntry(fs, &entry, (unsigned char*) buf, count, offset);
+    if(got == 0 && count > 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return got;
+}
+
+int fat32_extract(fat32_t *fs, const char *path, const char *host_path, int workers)
+{
+    struct DirectoryEntry entry;
+
+    if(lookupPath(fs, path, &entry) != 0)
+    {
+        return -1;
+    }
+    if(entry.DIR_Attr & ATTR_DIRECTORY)
+    {
+        errno = EISDIR;
+        return -1;
+    }
+
+    int outFd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(outFd < 0)
+    {
+        return -1;
+    }
+
+    int status = fat32__extractEntry(fs, &entry, outFd, workers);
+    if(close(outFd) != 0)
+    {
+        status = -1;
+    }
+    return status;
+}
@@ -0,0 +1,107 @@
+// The MIT License (MIT)
+// 
+// Copyright (c) 2020 Trevor Bakker 
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// libfat32: read-only access to FAT32 images from any program. Every call
+// works on an open handle and nothing is kept in process globals, so many
+// images can be open at once and one handle can be shared by threads.
+// Paths are absolute, like /DIR1/SUB/DEEP.TXT, and may use long names.
+// Calls that fail return -1 or NULL and set errno.
+
+#ifndef FAT32_H
+#define FAT32_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// The library is built with hidden visibility, only these calls are exported
+#define FAT32_API __attribute__((visibility("default")))
+
+// An open image
+typedef struct Image fat32_t;
+
+// A directory being listed with fat32_readdir
+typedef struct fat32_dir fat32_dir_t;
+
+// How fat32_extract reads the image
+#define FAT32_ENGINE_SYNC 0
+#define FAT32_ENGINE_URING 1
+#define FAT32_ENGINE_THREADS 2
+
+struct fat32_options
+{
+    // Serve reads from a read-only mapping of the image
+    bool use_mmap;
+    // FAT32_ENGINE_* and how many reads it keeps in flight, a depth below 1
+    // means the default
+    int engine;
+    int queue_depth;
+    // Keep FAT #1 in memory instead of reading each entry
+    bool fat_cache;
+    // Let the kernel copy file data when both sides allow it
+    bool zero_copy;
+    // Largest single transfer fat32_extract issues, at least 512 bytes, a
+    // smaller value means the default
+    size_t max_io_size;
+};
+
+// Longest name in UTF-8, 255 UCS-2 characters
+#define FAT32_NAME_MAX (255 * 3 + 1)
+
+#define FAT32_ATTR_READ_ONLY 0x01
+#define FAT32_ATTR_HIDDEN 0x02
+#define FAT32_ATTR_SYSTEM 0x04
+#define FAT32_ATTR_DIRECTORY 0x10
+#define FAT32_ATTR_ARCHIVE 0x20
+
+struct fat32_stat
+{
+    // Long name when there is one, NAME.EXT otherwise
+    char name[FAT32_NAME_MAX];
+    uint8_t attr;
+    uint32_t size;
+    uint32_t cluster;
+    // Runs of consecutive clusters, only filled in by fat32_stat
+    uint32_t extents;
+};
+
+//Fills options with the defaults fat32_open uses when given NULL
+FAT32_API void fat32_default_options(struct fat32_options *options);
+
+FAT32_API fat32_t *fat32_open(const char *path, const struct fat32_options *options);
+FAT32_API void fat32_close(fat32_t *fs);
+
+FAT32_API int fat32_stat(fat32_t *fs, const char *path, struct fat32_stat *st);
+
+//Lists a directory: fat32_readdir returns 1 for each entry, then 0
+FAT32_API fat32_dir_t *fat32_opendir(fat32_t *fs, const char *path);
+FAT32_API int fat32_readdir(fat32_dir_t *dir, struct fat32_stat *st);
+FAT32_API void fat32_closedir(fat32_dir_t *dir);
+
+//Reads up to count bytes of a file from offset, returns the bytes read
+FAT32_API ssize_t fat32_pread(fat32_t *fs, const char *path, void *buf, size_t count, uint64_t offset);
+
+//Copies a file to host_path with workers threads
+FAT32_API int fat32_extract(fat32_t *fs, const char *path, const char *host_path, int workers);
+
+#endif
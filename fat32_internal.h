@@ -0,0 +1,407 @@
+// The MIT License (MIT)
+// 
+// Copyright (c) 2020 Trevor Bakker 
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Internals of libfat32. Programs using the library only need fat32.h;
+// the mfs shell also includes this header for its diagnostic commands.
+// Everything it declares is prefixed fat32__, the rest of fat32.c is static.
+
+#ifndef FAT32_INTERNAL_H
+#define FAT32_INTERNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "fat32.h"
+
+// How extraction reads the image: one synchronous read at a time, io_uring,
+// or a pool of pread threads
+#define IO_ENGINE_SYNC FAT32_ENGINE_SYNC
+#define IO_ENGINE_URING FAT32_ENGINE_URING
+#define IO_ENGINE_THREADS FAT32_ENGINE_THREADS
+
+// Largest single read the async engines queue, so a deep queue doesn't pin
+// maxIOSize bytes per slot
+#define ASYNC_CHUNK_SIZE (1024 * 1024)
+
+//Smallest transfer size a copy may be split into
+#define MIN_IO_SIZE 512
+
+struct __attribute__((__packed__)) DirectoryEntry
+{
+    char DIR_Name[11];
+    uint8_t DIR_Attr;
+    uint8_t Unused1[8];
+    uint16_t DIR_FirstClusterHigh;
+    uint8_t Unused2[4];
+    uint16_t DIR_FirstClusterLow;
+    uint32_t DIR_FileSize;
+
+};
+
+#define ATTR_READ_ONLY 0x01
+#define ATTR_HIDDEN 0x01
+#define ATTR_SYSTEM 0x04
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LONG_NAME 0x0F
+
+// A VFAT long name piece, stored just before its short entry in reverse
+// order. Each piece holds 13 UCS-2 characters of the name.
+struct __attribute__((__packed__)) LongNameEntry
+{
+    uint8_t LDIR_Ord;
+    uint16_t LDIR_Name1[5];
+    uint8_t LDIR_Attr;
+    uint8_t LDIR_Type;
+    uint8_t LDIR_Chksum;
+    uint16_t LDIR_Name2[6];
+    uint16_t LDIR_FstClusLO;
+    uint16_t LDIR_Name3[2];
+};
+
+#define LAST_LONG_ENTRY 0x40
+#define LONG_NAME_CHARS 13
+
+//A long name holds at most 255 UCS-2 characters, which fit in 20 pieces
+#define LONG_NAME_UNITS 255
+#define LONG_NAME_PIECES ((LONG_NAME_UNITS + LONG_NAME_CHARS - 1) / LONG_NAME_CHARS)
+
+//255 UCS-2 characters take at most 3 UTF-8 bytes each, a surrogate pair
+//takes 4 bytes for its 2 characters
+#define LONG_NAME_MAX (LONG_NAME_UNITS * 3 + 1)
+
+//8.3 names are 11 bytes, kept in 16 so they can be compared in one load
+#define SHORT_NAME_BUFFER 16
+
+//FAT32 directories hold at most 65536 entries
+#define DIR_MAX_ENTRIES 65536
+
+// Cluster list of one file, built the first time the file is read so that
+// readfile can jump straight to the cluster holding any offset. Shared by
+// the cache and its readers, freed when the last reference is released.
+struct ClusterIndex
+{
+    uint32_t firstCluster;
+    uint32_t count;
+    uint32_t *clusters;
+    int refs;
+};
+
+// Small cache of cluster indexes keyed by first cluster, least recently
+// used slot is reused
+#define CLUSTER_INDEX_SLOTS 8
+
+struct ClusterIndexSlot
+{
+    struct ClusterIndex *index;
+    unsigned long lastUsed;
+};
+
+// Hash index of one directory's entries keyed by their 11-byte 8.3 name
+// and by their long name, built the first time the directory is searched.
+// The bucket and next arrays hold positions in entries, -1 ends a chain.
+struct DirIndex
+{
+    uint32_t cluster;
+    struct DirectoryEntry *entries;
+    uint32_t count;
+    int32_t *buckets;
+    uint32_t bucketCount;
+    int32_t *next;
+    //UTF-8 long name of each entry or NULL, hashed case-insensitively
+    char **longNames;
+    int32_t *longBuckets;
+    int32_t *longNext;
+    int refs;
+};
+
+// Directories whose index is kept, least recently used one is dropped
+#define DIR_INDEX_SLOTS 64
+
+struct DirIndexSlot
+{
+    struct DirIndex *index;
+    unsigned long lastUsed;
+};
+
+// One resolved path component: the entry called name in the directory
+// starting at parent. Kept in a fixed table indexed by hash, so a new
+// component simply replaces whatever held its slot.
+struct Dentry
+{
+    uint32_t parent;
+    uint32_t hash;
+    char *name;
+    struct DirectoryEntry entry;
+};
+
+#define DENTRY_CACHE_SLOTS 4096
+
+// One cached cluster, linked into its hash bucket and into the LRU list
+struct CacheBlock
+{
+    uint32_t cluster;
+    unsigned char *data;
+    bool prefetched;
+    struct CacheBlock *prev;
+    struct CacheBlock *next;
+    struct CacheBlock *hashNext;
+};
+
+// Bounded cluster-keyed LRU cache between the commands and the image. The
+// head of the list is the most recently used block. When a read follows the
+// chain from the previous one, the run of clusters stored right behind it
+// is prefetched in the same read. prefetched counts the ones later used.
+struct BlockCache
+{
+    struct CacheBlock **buckets;
+    int bucketCount;
+    struct CacheBlock *head;
+    struct CacheBlock *tail;
+    int count;
+    int capacity;
+    int readahead;
+    uint32_t lastCluster;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long prefetched;
+    unsigned long long bytesSaved;
+};
+
+// An open image, the fat32_t of the public API: the BPB geometry, the fd
+// every read goes through by offset with pread, the optional mapping and
+// the caches. Nothing here depends on
+// a file position, so several threads can read one image at once; the
+// caches are guarded by lock.
+struct Image
+{
+    int fd;
+    // Read-only mapping of the whole image when it was opened with --mmap
+    unsigned char *map;
+    size_t size;
+    bool isRegular;
+
+    uint16_t BPB_BytesPerSec;
+    uint8_t BPB_SecPerClus;
+    uint16_t BPB_RsvdSecCnt;
+    uint8_t BPB_NumFATS;
+    uint32_t BPB_FATSz32;
+    uint32_t BPB_RootClus;
+
+    // Size of one allocation unit, BPB_BytesPerSec * BPB_SecPerClus. All
+    // data reads are done a cluster at a time.
+    uint32_t BytesPerCluster;
+
+    // In-memory copy of FAT #1, loaded once at open so chain walks don't
+    // have to read the image for every cluster hop. In mmap mode it points
+    // into the mapping instead of holding a copy.
+    uint32_t *FAT;
+    uint32_t FATEntries;
+    bool FATMapped;
+
+    // Data clusters in the volume, from the BPB. No chain is longer, so
+    // walks stop there even when the FAT isn't loaded.
+    uint32_t ClusterCount;
+
+    int ioEngine;
+    int ioQueueDepth;
+
+    // Copy settings, see struct fat32_options
+    bool zeroCopy;
+    size_t maxIOSize;
+
+    pthread_mutex_t lock;
+    struct ClusterIndexSlot clusterIndexCache[CLUSTER_INDEX_SLOTS];
+    unsigned long clusterIndexClock;
+    struct DirIndexSlot dirIndexCache[DIR_INDEX_SLOTS];
+    unsigned long dirIndexClock;
+    struct Dentry *dentries;
+    unsigned long dentryHits;
+    unsigned long dentryMisses;
+    struct BlockCache cache;
+
+    // Path the image was opened from and its sidecar index, if one is loaded
+    char *path;
+    struct Sidecar *sidecar;
+    // Set when open found an index that no longer matches the image
+    bool sidecarStale;
+};
+
+// A run of consecutive clusters in a chain
+struct Extent
+{
+    uint32_t cluster;
+    uint32_t length;
+};
+
+// Sidecar index written by 'index write' next to the image as <image>.idx.
+// It holds the whole directory tree, every file's extents and a summary of
+// free space so that ls, stat and path lookups are answered from it
+// instead of from the image. The file is a header followed by the node,
+// key, extent and name sections, each 8-byte aligned, and is used straight
+// from an mmap. Values are stored in host byte order.
+#define SIDECAR_MAGIC "MFSIDX1"
+#define SIDECAR_VERSION 1
+#define SIDECAR_NO_NAME UINT32_MAX
+
+struct SidecarHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t bytesPerCluster;
+    // The image the index was built from, checked on every load
+    uint64_t imageSize;
+    int64_t imageMtime;
+    int64_t imageMtimeNsec;
+    uint64_t fatChecksum;
+    uint32_t nodeCount;
+    uint32_t keyCount;
+    uint32_t extentCount;
+    uint32_t nameBytes;
+    uint32_t totalClusters;
+    uint32_t freeClusters;
+    uint32_t freeRuns;
+    uint32_t largestFreeRun;
+    uint64_t nodesOffset;
+    uint64_t keysOffset;
+    uint64_t extentsOffset;
+    uint64_t namesOffset;
+};
+
+// One directory entry of the tree. Node 0 is the root, the children of a
+// directory are stored next to each other in directory order.
+struct __attribute__((__packed__)) SidecarNode
+{
+    struct DirectoryEntry entry;
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t childCount;
+    uint32_t firstExtent;
+    uint32_t extentCount;
+    uint32_t nameOffset;
+};
+
+// Nodes sorted by first cluster, to find the node of a directory or file
+struct SidecarKey
+{
+    uint32_t cluster;
+    uint32_t node;
+};
+
+struct Sidecar
+{
+    unsigned char *map;
+    size_t size;
+    char *path;
+    const struct SidecarHeader *header;
+    const struct SidecarNode *nodes;
+    const struct SidecarKey *keys;
+    const struct Extent *extents;
+    const char *names;
+};
+
+// One entry of a tree walked by fat32__walkTree. Directories get their
+// children filled in by whichever walker thread lists them.
+struct WalkNode
+{
+    struct DirectoryEntry entry;
+    char *name;
+    struct WalkNode *children;
+    uint32_t childCount;
+};
+
+// Bounded queue handing work from one stage to the next: between the
+// mget stages and from the daemon's listener to its workers. put blocks
+// while it is full, get blocks while it is empty and returns NULL once it
+// is closed and drained.
+struct PipeQueue
+{
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+};
+
+// What get -r and mget moved, for their throughput summary
+struct CopyStats
+{
+    uint32_t files;
+    unsigned long long bytes;
+    int failures;
+    double seconds;
+};
+
+//Image access
+struct Image *fat32__imageOpen(const char *path, const struct fat32_options *options);
+void fat32__imageClose(struct Image *img);
+int fat32__loadFAT(struct Image *img);
+void fat32__freeFAT(struct Image *img);
+uint32_t fat32__firstCluster(struct DirectoryEntry *entry);
+uint32_t fat32__dirCluster(struct Image *img, struct DirectoryEntry *entry);
+int fat32__buildExtents(struct Image *img, uint32_t cluster, uint32_t fileSize, struct Extent **extents);
+int fat32__writeAll(int fd, const unsigned char *buf, size_t len);
+
+//Caches
+void fat32__cacheClear(struct Image *img);
+struct DirIndex *fat32__getDirIndex(struct Image *img, uint32_t directory);
+void fat32__releaseDirIndex(struct Image *img, struct DirIndex *index);
+void fat32__freeDirIndexes(struct Image *img);
+void fat32__dentryClear(struct Image *img);
+
+//Sidecar index
+char *fat32__sidecarDefaultPath(struct Image *img);
+int fat32__sidecarLoad(struct Image *img, const char *path);
+void fat32__sidecarUnload(struct Image *img);
+int fat32__sidecarWrite(struct Image *img, const char *path);
+
+//Names and paths
+void fat32__entryDisplayName(struct DirectoryEntry *entry, const char *longName, char *out);
+int fat32__resolvePath(struct Image *img, uint32_t directory, const char *path, struct DirectoryEntry *found);
+const char *fat32__pathBaseName(const char *path);
+
+//Reading and copying files
+uint32_t fat32__preadEntry(struct Image *img, struct DirectoryEntry *entry, unsigned char *buf, uint32_t count, uint32_t position);
+int fat32__extractEntry(struct Image *img, struct DirectoryEntry *entry, int outFd, int workers);
+int fat32__streamFile(struct Image *img, struct DirectoryEntry *entry, uint32_t position, uint32_t count, int outFd);
+
+//Whole trees
+struct WalkNode *fat32__walkTree(struct Image *img, struct DirectoryEntry *root, const char *rootName, int workers);
+void fat32__freeWalkTree(struct WalkNode *node, bool top);
+int fat32__walkWorkers(void);
+int fat32__getTree(struct Image *img, struct DirectoryEntry *root, const char *rootName, const char *hostDir, int workers, struct CopyStats *stats);
+int fat32__mget(struct Image *img, uint32_t directory, const char *pattern, const char *hostDir, struct CopyStats *stats);
+
+//Work queues
+void fat32__pipeInit(struct PipeQueue *queue, int capacity);
+void fat32__pipeDestroy(struct PipeQueue *queue);
+void fat32__pipePut(struct PipeQueue *queue, void *item);
+void *fat32__pipeGet(struct PipeQueue *queue);
+void fat32__pipeClose(struct PipeQueue *queue);
+
+#endif
@@ -30,10 +30,22 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <stdint.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fat32_internal.h"
 
 #define MAX_NUM_ARGUMENTS 10
 
@@ -44,653 +56,1965 @@
 
 #define MAX_COMMAND_SIZE 255    // The maximum command-line size
 
-FILE *fp;
+// Settings handed to the library when an image is opened. The commands that
+// change them also apply them to the image that is already open.
 
-struct __attribute__((__packed__)) DirectoryEntry
+// get copies contiguous runs inside the kernel when the image is a regular
+// file, switched with the zerocopy command
+bool zeroCopyEnabled = true;
+
+// Whether open loads the FAT table, switched with the fatcache command
+bool fatCacheEnabled = true;
+
+// Largest single read/write get will issue for one extent, set with iosize
+size_t MaxIOSize = 8 * 1024 * 1024;
+
+// Where commands come from: the terminal or a pipe with a prompt, a script
+// file with -f, or the ; separated list given with -c
+struct CommandSource
+{
+    FILE *file;
+    const char *list;
+    bool prompt;
+};
+
+// Scratch memory for one command: the line, its tokens and anything a
+// handler needs until it returns. Allocating is a pointer bump and the
+// whole arena is emptied with one reset, so memory stays flat no matter
+// how many commands are run.
+#define COMMAND_ARENA_SIZE (64 * 1024)
+
+struct Arena
 {
-    char DIR_Name[11];
-    uint8_t DIR_Attr;
-    uint8_t Unused1[8];
-    uint16_t DIR_FirstClusterHigh;
-    uint8_t Unused2[4];
-    uint16_t DIR_FirstClusterLow;
-    uint32_t DIR_FileSize;
+    char *base;
+    size_t size;
+    size_t used;
+};
 
+// State the command handlers share: the open image, the cluster of the
+// current directory and the arena of the command being run. The shell
+// prints to stdout, a daemon session to the reply of its request.
+struct Shell
+{
+    struct Image *img;
+    uint32_t currentDirectory;
+    bool quit;
+    struct Arena arena;
+    FILE *out;
+    // Set when a command reports an error, so batch runs can exit with 1
+    // and daemon replies start with ERR
+    bool failed;
+    // A daemon session shares the daemon's image, it can't open, close or
+    // retune it
+    bool shared;
 };
 
-struct DirectoryEntry Dir[16];
-  
-#define ATTR_READ_ONLY 0x01
-#define ATTR_HIDDEN 0x01
-#define ATTR_SYSTEM 0x04
-#define ATTR_DIRECTORY 0x10
-#define ATTR_ARCHIVE 0x20
+//Prints a command's error message and remembers that something failed
+void commandError(struct Shell *shell, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(shell->out, format, args);
+    va_end(args);
+    shell->failed = true;
+}
+
+//Copies the next command into line, ending it with a newline like fgets
+//does. Blanks around the command and a DOS line ending are dropped. A
+//command that doesn't fit is reported and skipped whole, line is left
+//empty so no part of it runs. Returns false at the end of the input.
+bool nextCommand(struct Shell *shell, struct CommandSource *source, char *line, int size)
+{
+    size_t length;
+    bool tooLong = false;
+
+    if(source->list != NULL)
+    {
+        if(*source->list == '\0')
+        {
+            return false;
+        }
+
+        length = strcspn(source->list, ";\n");
+        if(length > (size_t)size - 2)
+        {
+            tooLong = true;
+            line[0] = '\0';
+        }
+        else
+        {
+            memcpy(line, source->list, length);
+            line[length] = '\0';
+        }
+
+        //Skip the separator so the next call starts on the next command
+        source->list += length;
+        if(*source->list == ';' || *source->list == '\n')
+        {
+            source->list++;
+        }
+    }
+    else
+    {
+        if(source->prompt)
+        {
+            printf("mfs> ");
+            fflush(stdout);
+        }
+        if(fgets(line, size, source->file) == NULL)
+        {
+            //End the prompt line so the shell's own prompt starts clean
+            if(source->prompt)
+            {
+                printf("\n");
+            }
+            return false;
+        }
+
+        //A line still missing its newline at full length was cut short by
+        //fgets, the rest of it is thrown away
+        if(strchr(line, '\n') == NULL && strlen(line) > (size_t)size - 2)
+        {
+            int c = getc(source->file);
+            while(c != EOF && c != '\n')
+            {
+                c = getc(source->file);
+            }
+            tooLong = true;
+            line[0] = '\0';
+        }
+    }
+
+    if(tooLong)
+    {
+        commandError(shell, "Error: Command longer than %d characters\n", size - 2);
+    }
+
+    size_t blanks = strspn(line, " \t");
+    length = strlen(line + blanks);
+    memmove(line, line + blanks, length + 1);
+    while(length > 0 && strchr(" \t\r\n", line[length - 1]) != NULL)
+    {
+        length--;
+    }
+    line[length] = '\n';
+    line[length + 1] = '\0';
+    return true;
+}
+
+void arenaInit(struct Arena *arena, size_t size)
+{
+    arena->base = (char*) malloc(size);
+    arena->size = size;
+    arena->used = 0;
+}
+
+//Returns len bytes aligned for any type, or NULL when the arena is full
+void *arenaAlloc(struct Arena *arena, size_t len)
+{
+    size_t start = (arena->used + 15) & ~(size_t)15;
+
+    if(start > arena->size || len > arena->size - start)
+    {
+        return NULL;
+    }
+    arena->used = start + len;
+    return arena->base + start;
+}
+
+void arenaReset(struct Arena *arena)
+{
+    arena->used = 0;
+}
+
+void arenaFree(struct Arena *arena)
+{
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+//Splits line on whitespace in place into token, the unused slots after
+//the tokens are set to NULL. Returns how many tokens there are, or -1
+//when there are more than fit in max - 1.
+int tokenize(char *line, char **token, int max)
+{
+    int count = 0;
+
+    while(*line != '\0')
+    {
+        line += strspn(line, WHITESPACE);
+        if(*line == '\0')
+        {
+            break;
+        }
+        if(count == max - 1)
+        {
+            return -1;
+        }
+
+        token[count++] = line;
+        line += strcspn(line, WHITESPACE);
+        if(*line != '\0')
+        {
+            *line++ = '\0';
+        }
+    }
+    memset(&token[count], 0, (max - count) * sizeof(char*));
+    return count;
+}
+
+//Ls function to list files which are undeleted.
+void ls(struct Shell *shell, uint32_t directory)
+{
+    struct DirIndex *index = fat32__getDirIndex(shell->img, directory);
+    uint32_t i;
+
+    //The index holds live short entries with their long names, in order
+    for(i = 0; i < index->count; i++)
+    {
+        struct DirectoryEntry *entry = &index->entries[i];
+        char filename[12];
+        strncpy(filename, entry->DIR_Name, 11);
+        filename[11]='\0';
+        if (entry->DIR_Attr == ATTR_READ_ONLY || entry->DIR_Attr ==ATTR_DIRECTORY 
+        || entry->DIR_Attr == ATTR_ARCHIVE)
+        {
+            fprintf(shell->out, "%s\n", index->longNames[i] ? index->longNames[i] : filename );
+        }
+    }
+    fat32__releaseDirIndex(shell->img, index);
+}
+
+// tree, du and find build the path or the branch prefix of every entry in
+// one buffer from the arena, a subtree whose path doesn't fit is skipped
+#define WALK_PATH_SIZE 4096
+
+//Adds /name to the path of length pathLength in place. Returns the new
+//length, or 0 when it doesn't fit in size.
+size_t appendPath(char *path, size_t pathLength, size_t size, const char *name)
+{
+    bool slash = pathLength > 0 && path[pathLength - 1] != '/';
+    size_t nameLength = strlen(name);
+
+    if(pathLength + slash + nameLength + 1 > size)
+    {
+        return 0;
+    }
+    if(slash)
+    {
+        path[pathLength++] = '/';
+    }
+    memcpy(path + pathLength, name, nameLength + 1);
+    return pathLength + nameLength;
+}
+
+//Prints the tree below node with ASCII branches and counts what it shows
+void printTree(struct Shell *shell, struct WalkNode *node, char *prefix, size_t prefixLength, int *directories, int *files)
+{
+    uint32_t i;
+
+    for(i = 0; i < node->childCount; i++)
+    {
+        struct WalkNode *child = &node->children[i];
+        bool last = i + 1 == node->childCount;
+
+        fprintf(shell->out, "%s%s%s\n", prefix, last ? "`-- " : "|-- ", child->name);
+
+        if(child->entry.DIR_Attr & ATTR_DIRECTORY)
+        {
+            (*directories)++;
+            if(prefixLength + 5 < WALK_PATH_SIZE)
+            {
+                strcpy(prefix + prefixLength, last ? "    " : "|   ");
+                printTree(shell, child, prefix, prefixLength + 4, directories, files);
+                prefix[prefixLength] = '\0';
+            }
+        }
+        else
+        {
+            (*files)++;
+        }
+    }
+}
+
+//Prints the total file size below each directory after its children, the
+//way du does, and returns the total for node. path holds node's path and
+//is left as it was.
+unsigned long long printDiskUsage(struct Shell *shell, struct WalkNode *node, char *path, size_t pathLength)
+{
+    unsigned long long total = 0;
+    uint32_t i;
+
+    for(i = 0; i < node->childCount; i++)
+    {
+        struct WalkNode *child = &node->children[i];
+
+        if(child->entry.DIR_Attr & ATTR_DIRECTORY)
+        {
+            size_t childLength = appendPath(path, pathLength, WALK_PATH_SIZE, child->name);
+            if(childLength == 0)
+            {
+                commandError(shell, "Error: Path too long below %s\n", path);
+                continue;
+            }
+            total += printDiskUsage(shell, child, path, childLength);
+            path[pathLength] = '\0';
+        }
+        else
+        {
+            total += child->entry.DIR_FileSize;
+        }
+    }
+
+    fprintf(shell->out, "%llu\t%s\n", total, path);
+    return total;
+}
+
+//Prints the path of every entry below node whose name matches pattern,
+//ignoring case. Returns how many matched.
+int printMatches(struct Shell *shell, struct WalkNode *node, char *path, size_t pathLength, const char *pattern)
+{
+    int matches = 0;
+    uint32_t i;
+
+    for(i = 0; i < node->childCount; i++)
+    {
+        struct WalkNode *child = &node->children[i];
+        size_t childLength = appendPath(path, pathLength, WALK_PATH_SIZE, child->name);
+
+        if(childLength == 0)
+        {
+            commandError(shell, "Error: Path too long below %s\n", path);
+            continue;
+        }
+        if(fnmatch(pattern, child->name, FNM_CASEFOLD) == 0)
+        {
+            fprintf(shell->out, "%s\n", path);
+            matches++;
+        }
+        if(child->entry.DIR_Attr & ATTR_DIRECTORY)
+        {
+            matches += printMatches(shell, child, path, childLength, pattern);
+        }
+        path[pathLength] = '\0';
+    }
+    return matches;
+}
+
+// read prints xxd style lines: an 8 digit offset, 16 bytes in groups of
+// two as hex, then the printable bytes as text
+#define HEX_DUMP_LINE 68
+
+static const char hexDigits[] = "0123456789abcdef";
+
+//Formats one line of up to 16 bytes at out, returns its length
+size_t hexDumpLine(const unsigned char *data, size_t len, uint64_t offset, char *out)
+{
+    char hex[32];
+    char text[16];
+    size_t i;
+
+    for(i = 0; i < 8; i++)
+    {
+        out[i] = hexDigits[(offset >> (28 - 4 * i)) & 0xf];
+    }
+    out[8] = ':';
+    out[9] = ' ';
+
+#ifdef __SSE2__
+    if(len == 16)
+    {
+        //Both nibbles of every byte at once: n + '0', plus 39 more for a-f,
+        //interleaved high then low to get the digits in order
+        __m128i bytes = _mm_loadu_si128((const __m128i*) data);
+        __m128i mask = _mm_set1_epi8(0x0f);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+        __m128i low = _mm_and_si128(bytes, mask);
+        __m128i nine = _mm_set1_epi8(9);
+        __m128i zero = _mm_set1_epi8('0');
+        __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+
+        high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letters));
+        low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letters));
+        _mm_storeu_si128((__m128i*) hex, _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*) (hex + 16), _mm_unpackhi_epi8(high, low));
+
+        //Bytes from 0x20 to 0x7e show as themselves, others as '.'
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)),
+                                          _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+        _mm_storeu_si128((__m128i*) text, _mm_or_si128(_mm_and_si128(printable, bytes),
+                                                      _mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+    }
+    else
+#endif
+    {
+        memset(hex, ' ', sizeof(hex));
+        for(i = 0; i < len; i++)
+        {
+            hex[2 * i] = hexDigits[data[i] >> 4];
+            hex[2 * i + 1] = hexDigits[data[i] & 0xf];
+            text[i] = data[i] >= 0x20 && data[i] < 0x7f ? data[i] : '.';
+        }
+    }
+
+    for(i = 0; i < 8; i++)
+    {
+        memcpy(out + 10 + 5 * i, hex + 4 * i, 4);
+        out[14 + 5 * i] = ' ';
+    }
+    out[50] = ' ';
+    memcpy(out + 51, text, len);
+    out[51 + len] = '\n';
+    return 52 + len;
+}
+
+// read and cat take the file READ_CHUNK bytes at a time through the arena
+// when the output isn't a file descriptor, as for a daemon reply
+#define READ_CHUNK (8 * 1024)
 
-uint16_t BPB_BytesPerSec;
-uint8_t BPB_SecPerClus;
-uint16_t BPB_RsvdSecCnt;
-uint8_t BPB_NumFATS;
-uint32_t BPB_FATSz32;
-int32_t currDirectory;
+//Dumps the count bytes of entry from position as hex lines, formatted a
+//chunk at a time in the arena. Returns 0 on success, -1 with errno set to
+//EIO when the image holds less of the file than its size.
+int hexDump(struct Shell *shell, struct DirectoryEntry *entry, uint32_t position, uint32_t count)
+{
+    unsigned char *data = (unsigned char*) arenaAlloc(&shell->arena, READ_CHUNK);
+    char *out = (char*) arenaAlloc(&shell->arena, READ_CHUNK / 16 * HEX_DUMP_LINE);
+
+    if(data == NULL || out == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while(count > 0)
+    {
+        uint32_t chunk = count < READ_CHUNK ? count : READ_CHUNK;
+        size_t used = 0;
+        size_t i;
+
+        if(fat32__preadEntry(shell->img, entry, data, chunk, position) != chunk)
+        {
+            errno = EIO;
+            return -1;
+        }
+        for(i = 0; i < chunk; i += 16)
+        {
+            used += hexDumpLine(data + i, chunk - i < 16 ? chunk - i : 16, position + i, out + used);
+        }
+        if(fwrite(out, 1, used, shell->out) != used)
+        {
+            return -1;
+        }
+        position += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
 
-int16_t NextLB(uint32_t sector)
+//Sends count bytes of entry from position to the output as they are. On
+//a terminal, pipe or file the library streams them to its descriptor,
+//other outputs get them a chunk at a time. Returns 0 on success, -1 with
+//errno set to EIO when the image holds less of the file than asked.
+int sendFile(struct Shell *shell, struct DirectoryEntry *entry, uint32_t position, uint32_t count)
 {
-    uint32_t FATAddress = (BPB_BytesPerSec*BPB_RsvdSecCnt)+(sector*4);
-    int16_t val;
-    fseek(fp, FATAddress, SEEK_SET);
-    fread(&val, 2, 1, fp);
-    return val;
+    int outFd = fileno(shell->out);
+
+    if(outFd >= 0)
+    {
+        fflush(shell->out);
+        return fat32__streamFile(shell->img, entry, position, count, outFd);
+    }
+
+    unsigned char *data = (unsigned char*) arenaAlloc(&shell->arena, READ_CHUNK);
+    if(data == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    //Reads never go past the end of the file
+    if(position >= entry->DIR_FileSize)
+    {
+        count = 0;
+    }
+    else if(count > entry->DIR_FileSize - position)
+    {
+        count = entry->DIR_FileSize - position;
+    }
+
+    while(count > 0)
+    {
+        uint32_t chunk = count < READ_CHUNK ? count : READ_CHUNK;
+
+        if(fat32__preadEntry(shell->img, entry, data, chunk, position) != chunk)
+        {
+            errno = EIO;
+            return -1;
+        }
+        if(fwrite(data, 1, chunk, shell->out) != chunk)
+        {
+            return -1;
+        }
+        position += chunk;
+        count -= chunk;
+    }
+    return 0;
 }
 
-int LBAToOffset(int32_t sector)
+//This function requires the filename, position and a position parameter to 
+//specify the number of bytes in hexadecimal. 
+int readfile(struct Shell *shell, char *filename, int requested_Offset, int requestedBytes)
 {
-    return ((sector - 2) * BPB_BytesPerSec) + (BPB_BytesPerSec * BPB_RsvdSecCnt) + (BPB_NumFATS * BPB_FATSz32 * BPB_BytesPerSec);
+    struct DirectoryEntry entry;
+    
+    if(requested_Offset < 0 || requestedBytes < 0)
+    {
+        commandError(shell, "Error: offset can't be negative\n");
+        return -1;
+    }
+
+    if(!fat32__resolvePath(shell->img, shell->currentDirectory, filename, &entry))
+    {
+        commandError(shell, "Error: File not found\n");
+        return -1;
+    }
+
+    //Reads never go past the end of the file
+    uint32_t fileSize = entry.DIR_FileSize;
+    uint32_t position = requested_Offset;
+    uint32_t count = position >= fileSize ? 0 : (uint32_t)requestedBytes > fileSize - position ? fileSize - position : requestedBytes;
+
+    if(hexDump(shell, &entry, position, count) != 0)
+    {
+        commandError(shell, errno == EIO ? "Error: Unable to read %s from the image\n"
+                                         : "Error: Unable to write %s\n", filename);
+        return -1;
+    }
+
+    return 0;
 }
- 
- //Compare function to compare two files
-int compare(char *user, char *directory)
+
+//getFile function to retreive files/directory in place in current directory
+void getFile(struct Shell *shell, char *olderfilename, char *newfilename, int workers)
 {
-    char *spacing = "..";
+    struct Image *img = shell->img;
+    struct DirectoryEntry entry;
+    FILE *oldpointer;
+
+    // Checking if the file or folder already exists or not
+    // if not, an error is thrown
+    if (!fat32__resolvePath(img, shell->currentDirectory, olderfilename, &entry) || (entry.DIR_Attr & ATTR_DIRECTORY))
+    {
+        commandError(shell, "ERROR: File not found.\n");
+        return;
+    }
+  //opening the original file incase new file is not provided.
+  //A path copies to its last component.
+    if(newfilename == NULL)
+    {
+        oldpointer = fopen(fat32__pathBaseName(olderfilename), "w");
+        if(oldpointer == NULL)
+        {
+            commandError(shell, "Error: Cant open new file %s\n", fat32__pathBaseName(olderfilename));
+            return;
+        }
+    }
+    else
+    {
+        oldpointer = fopen(newfilename, "w");
+
+        if(oldpointer == NULL)
+        {
+            commandError(shell, "Error: Cant open new file %s\n", newfilename);
+            return;
+        }
+    }
 
-    if(strncmp(spacing, user, 2) == 0)
+    //EIO means the image ran out before the file did
+    if(fat32__extractEntry(img, &entry, fileno(oldpointer), workers) != 0)
     {
-        if(strncmp(user, directory, 2) == 0)
+        if(errno == EIO)
+        {
+            commandError(shell, "Error: Unable to read %s from the image\n", olderfilename);
+        }
+        else
         {
-            return 1;
+            commandError(shell, "Error: Unable to write %s\n", newfilename ? newfilename : olderfilename);
         }
-            return 0;
     }
 
-    char IMG_Name[12];
-    strncpy(IMG_Name, directory, 11);
-    IMG_Name[11] = '\0';
-    char input[11];
-    memset(input, 0, 11);
-    strncpy(input, user, strlen(user));
-    char expanded_name[12];
-    memset(expanded_name, ' ', 12);
-    char *token = strtok(input, ".");
-    strncpy(expanded_name, token, strlen(token));
-    token = strtok(NULL, ".");
+    fclose(oldpointer);
+}
+
+//Summary printed after get -r and mget
+void printCopyStats(struct Shell *shell, struct CopyStats *stats)
+{
+    double seconds = stats->seconds > 0 ? stats->seconds : 1e-9;
+
+    if(stats->failures > 0)
+    {
+        commandError(shell, "Error: %d files could not be copied\n", stats->failures);
+    }
+    fprintf(shell->out, "Copied %u files, %llu bytes in %.3f s: %.1f files/s, %.1f MB/s\n", stats->files, stats->bytes,
+            seconds, stats->files / seconds, stats->bytes / seconds / (1024 * 1024));
+}
+
+//Runs one command line, defined with the command table below
+void runCommand(struct Shell *shell, char *line);
+
+// Daemon mode, mfs --serve <socket> <image>. One image stays open with its
+// FAT, caches and indexes warm and serves every client that connects to
+// the Unix socket. A client sends one command per line and gets back a
+// header line, "OK <bytes>" or "ERR <bytes>", followed by that many bytes
+// of output. Each session is a shell of its own with its current
+// directory, running the shell's commands with their output caught in the
+// reply.
+//
+// The listener waits on all sessions with epoll. A session whose socket
+// becomes readable is handed to the worker pool and is not watched again
+// until the worker is done with it, so one session is never served by two
+// workers at once.
+#define SERVE_QUEUE_DEPTH 256
+#define SERVE_MAX_EVENTS 64
+#define SERVE_REPLY_LIMIT (64 * 1024 * 1024)
+
+// Output of one request, sent after the header once it is complete
+struct Reply
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+struct Session
+{
+    int fd;
+    struct Shell shell;
+    struct Reply reply;
+    char input[MAX_COMMAND_SIZE];
+    size_t used;
+};
+
+struct Server
+{
+    struct Image *img;
+    int epollFd;
+    struct PipeQueue ready;
+};
 
-    if(token)
+volatile sig_atomic_t serverStopping = 0;
+
+void serverStop(int signal)
+{
+    (void) signal;
+    serverStopping = 1;
+}
+
+//Stream behind a session's shell output, appending to its reply. Writes
+//past SERVE_REPLY_LIMIT fail.
+ssize_t replyWrite(void *cookie, const char *buf, size_t len)
+{
+    struct Reply *reply = (struct Reply*) cookie;
+
+    if(len > SERVE_REPLY_LIMIT - reply->length)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    if(reply->length + len > reply->capacity)
+    {
+        size_t capacity = reply->capacity ? reply->capacity : 256;
+        while(capacity < reply->length + len)
+        {
+            capacity *= 2;
+        }
+        reply->data = (char*) realloc(reply->data, capacity);
+        reply->capacity = capacity;
+    }
+    memcpy(reply->data + reply->length, buf, len);
+    reply->length += len;
+    return len;
+}
+
+static const cookie_io_functions_t replyStream = { NULL, replyWrite, NULL, NULL };
+
+//Makes a session for a client connected on fd, NULL when out of memory
+struct Session *sessionOpen(struct Server *server, int fd)
+{
+    struct Session *session = (struct Session*) calloc(1, sizeof(struct Session));
+
+    if(session == NULL)
+    {
+        return NULL;
+    }
+    session->fd = fd;
+    session->shell.img = server->img;
+    session->shell.currentDirectory = server->img->BPB_RootClus;
+    session->shell.shared = true;
+    session->shell.out = fopencookie(&session->reply, "w", replyStream);
+    arenaInit(&session->shell.arena, COMMAND_ARENA_SIZE);
+    if(session->shell.out == NULL || session->shell.arena.base == NULL)
+    {
+        if(session->shell.out != NULL)
+        {
+            fclose(session->shell.out);
+        }
+        arenaFree(&session->shell.arena);
+        free(session);
+        return NULL;
+    }
+    return session;
+}
+
+//Closing the fd takes it out of the epoll set
+void sessionClose(struct Session *session)
+{
+    close(session->fd);
+    fclose(session->shell.out);
+    arenaFree(&session->shell.arena);
+    free(session->reply.data);
+    free(session);
+}
+
+//Sends the header and the output of one request
+int sendReply(int fd, struct Reply *reply, bool failed)
+{
+    char header[32];
+    int len = snprintf(header, sizeof(header), "%s %zu\n", failed ? "ERR" : "OK", reply->length);
+
+    if(fat32__writeAll(fd, (unsigned char*) header, len) != 0)
+    {
+        return -1;
+    }
+    return fat32__writeAll(fd, (unsigned char*) reply->data, reply->length);
+}
+
+//Runs one request line through the session's shell and sends the reply.
+//Returns false when the session ends.
+bool serveCommand(struct Session *session, char *line)
+{
+    struct Shell *shell = &session->shell;
+
+    session->reply.length = 0;
+    shell->failed = false;
+    arenaReset(&shell->arena);
+    runCommand(shell, line);
+
+    //A reply that outgrew the limit is replaced by the error
+    if(fflush(shell->out) != 0 || ferror(shell->out))
+    {
+        clearerr(shell->out);
+        session->reply.length = 0;
+        commandError(shell, "Error: Reply longer than %d bytes\n", SERVE_REPLY_LIMIT);
+        fflush(shell->out);
+    }
+
+    //quit ends the session without a reply
+    if(shell->quit)
+    {
+        return false;
+    }
+    return sendReply(session->fd, &session->reply, shell->failed) == 0;
+}
+
+//Reads what the session has sent and answers every complete line in it.
+//Returns false when the session is over.
+bool serveSession(struct Session *session)
+{
+    bool open = true;
+    char *line;
+    char *end;
+
+    ssize_t got = read(session->fd, session->input + session->used, sizeof(session->input) - session->used);
+    if(got <= 0)
+    {
+        return false;
+    }
+    session->used += got;
+
+    line = session->input;
+    while(open && (end = (char*) memchr(line, '\n', session->input + session->used - line)) != NULL)
+    {
+        *end = '\0';
+        open = serveCommand(session, line);
+        line = end + 1;
+    }
+
+    //Keep a partial line for the next read. A full buffer with no line in
+    //it is more than any command can be, the client is told before the
+    //session is dropped.
+    session->used -= line - session->input;
+    memmove(session->input, line, session->used);
+    if(open && session->used == sizeof(session->input))
+    {
+        session->reply.length = 0;
+        session->shell.failed = false;
+        commandError(&session->shell, "Error: Command longer than %d characters\n", MAX_COMMAND_SIZE - 1);
+        fflush(session->shell.out);
+        sendReply(session->fd, &session->reply, true);
+
+        //Closing on unread input would reset the connection and could
+        //lose the reply, so what already arrived is read and dropped
+        while(recv(session->fd, session->input, sizeof(session->input), MSG_DONTWAIT) > 0)
+        {
+        }
+        return false;
+    }
+    return open;
+}
+
+void *serveWorker(void *arg)
+{
+    struct Server *server = (struct Server*) arg;
+    struct Session *session;
+
+    while((session = (struct Session*) fat32__pipeGet(&server->ready)) != NULL)
+    {
+        if(serveSession(session))
+        {
+            //Watch the session again now that this worker is done with it
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = session;
+            if(epoll_ctl(server->epollFd, EPOLL_CTL_MOD, session->fd, &event) == 0)
+            {
+                continue;
+            }
+        }
+
+        sessionClose(session);
+    }
+    return NULL;
+}
+
+//Serves img on the Unix socket at path until SIGINT or SIGTERM
+int serve(struct Image *img, const char *path, int workers)
+{
+    struct sockaddr_un address;
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    struct epoll_event event;
+    struct Server server;
+    struct stat pathStat;
+    int listenFd;
+    int w;
+
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Error: Socket path %s is too long\n", path);
+        return 1;
+    }
+
+    //A socket left behind by an earlier daemon is replaced
+    if(stat(path, &pathStat) == 0 && S_ISSOCK(pathStat.st_mode))
+    {
+        unlink(path);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listenFd < 0 || bind(listenFd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Error: Cant listen on %s: %s\n", path, strerror(errno));
+        if(listenFd >= 0)
+        {
+            close(listenFd);
+        }
+        return 1;
+    }
+
+    server.img = img;
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    fat32__pipeInit(&server.ready, SERVE_QUEUE_DEPTH);
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+    //A client hanging up mid reply must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = serverStop;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    pthread_t *threads = (pthread_t*) malloc(workers * sizeof(pthread_t));
+    int started = 0;
+    for(w = 0; w < workers; w++)
+    {
+        if(pthread_create(&threads[started], NULL, serveWorker, &server) == 0)
+        {
+            started++;
+        }
+    }
+
+    printf("Serving %s on %s with %d workers\n", img->path, path, started);
+    fflush(stdout);
+
+    while(!serverStopping && started > 0)
+    {
+        int ready = epoll_wait(server.epollFd, events, SERVE_MAX_EVENTS, -1);
+        int e;
+
+        for(e = 0; e < ready; e++)
+        {
+            struct Session *session = (struct Session*) events[e].data.ptr;
+
+            if(session != NULL)
+            {
+                fat32__pipePut(&server.ready, session);
+                continue;
+            }
+
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if(fd < 0)
+            {
+                continue;
+            }
+
+            session = sessionOpen(&server, fd);
+            if(session == NULL)
+            {
+                close(fd);
+                continue;
+            }
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = session;
+            if(epoll_ctl(server.epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+            {
+                sessionClose(session);
+            }
+        }
+    }
+
+    //Sessions still open when the daemon stops are left to process exit
+    fat32__pipeClose(&server.ready);
+    for(w = 0; w < started; w++)
+    {
+        pthread_join(threads[w], NULL);
+    }
+    free(threads);
+    fat32__pipeDestroy(&server.ready);
+    close(server.epollFd);
+    close(listenFd);
+    unlink(path);
+    printf("Closing the Fat32 System..\n");
+    return started > 0 ? 0 : 1;
+}
+
+
+//Open command to open file in read mode
+void cmdOpen(struct Shell *shell, char **token, int token_count)
+{
+    if (shell->img != NULL)
+    {
+        commandError(shell, "ERROR: File System image already open.\n");
+        return;
+    }
+
+    else if (token_count < 3 || token[1] == NULL)
+    {
+        commandError(shell, "ERROR: Usage: open [--mmap] [--engine sync|uring|threads] [--qd N] <image>\n");
+    }
+
+    else if (shell->img == NULL && token_count < MAX_NUM_ARGUMENTS)
+    {
+        //--mmap maps the image and serves reads from memory,
+        //--engine and --qd pick how get reads file data
+        bool useMmap = false;
+        char *imageName = NULL;
+        int engine = IO_ENGINE_SYNC;
+        int queueDepth = 32;
+        bool badOption = false;
+        int t;
+
+        for (t = 1; t < token_count && token[t] != NULL; t++)
+        {
+            if (strcmp(token[t], "--mmap") == 0)
+            {
+                useMmap = true;
+            }
+            else if (strcmp(token[t], "--engine") == 0 && token[t + 1] != NULL)
+            {
+                t++;
+                if (strcmp(token[t], "sync") == 0)
+                {
+                    engine = IO_ENGINE_SYNC;
+                }
+                else if (strcmp(token[t], "uring") == 0)
+                {
+                    engine = IO_ENGINE_URING;
+                }
+                else if (strcmp(token[t], "threads") == 0)
+                {
+                    engine = IO_ENGINE_THREADS;
+                }
+                else
+                {
+                    badOption = true;
+                }
+            }
+            else if (strcmp(token[t], "--qd") == 0 && token[t + 1] != NULL)
+            {
+                queueDepth = atoi(token[++t]);
+                if (queueDepth < 1 || queueDepth > 4096)
+                {
+                    badOption = true;
+                }
+            }
+            else
+            {
+                imageName = token[t];
+            }
+        }
+
+        if (badOption)
+        {
+            commandError(shell, "ERROR: Usage: open [--mmap] [--engine sync|uring|threads] [--qd N] <image>\n");
+            return;
+        }
+
+        struct fat32_options options;
+        options.use_mmap = useMmap;
+        options.engine = engine;
+        options.queue_depth = queueDepth;
+        options.fat_cache = fatCacheEnabled;
+        options.zero_copy = zeroCopyEnabled;
+        options.max_io_size = MaxIOSize;
+
+        if (imageName == NULL || (shell->img = fat32__imageOpen(imageName, &options)) == NULL)
+        {
+            commandError(shell, "Error: File system image not found.\n");
+            return;
+        }
+
+        if (useMmap && shell->img->map == NULL)
+        {
+            fprintf(shell->out, "Error: Unable to map the image, using regular reads.\n");
+        }
+        if (fatCacheEnabled && shell->img->FAT == NULL)
+        {
+            fprintf(shell->out, "Error: Unable to load the FAT, falling back to image reads.\n");
+        }
+        if (shell->img->sidecarStale)
+        {
+            char *indexPath = fat32__sidecarDefaultPath(shell->img);
+            fprintf(shell->out, "Index %s is out of date, ignoring it.\n", indexPath);
+            free(indexPath);
+        }
+
+        shell->currentDirectory = shell->img->BPB_RootClus;
+    }
+
+    else
+    {
+        commandError(shell, "ERROR: Too many arguments for open command.\n");
+    }
+}
+
+//Close command, checks if file is open and then closes the file
+//Sets file pointer to null after file is closed.
+void cmdClose(struct Shell *shell, char **token, int token_count)
+{
+    if (shell->img != NULL)
+    {
+        fat32__imageClose(shell->img);
+        shell->img = NULL;
+    }
+
+    else
+    {
+        commandError(shell, "Error: File system not open. \n");
+    }
+}
+
+//bpb command for the file systems info in both decimal and hexadecimal system
+void cmdBpb(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if(img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+
+    else
+    {
+        fprintf(shell->out, "BPB_BytesPerSec(Decimal): %d\n", img->BPB_BytesPerSec);
+        fprintf(shell->out, "BPB_BytesPerSec(HexaDecimal): 0x%x\n", img->BPB_BytesPerSec);
+
+        fprintf(shell->out, "BPB_SecPerClus(Decimal): %d\n", img->BPB_SecPerClus);
+        fprintf(shell->out, "BPB_SecPerClus (HexaDecimal): 0x%x\n", img->BPB_SecPerClus);
+
+        fprintf(shell->out, "BPB_RsvdSecCnt (Decimal): %d\n", img->BPB_RsvdSecCnt);
+        fprintf(shell->out, "BPB_RsvdSecCnt (HexaDecimal): 0x%x\n", img->BPB_RsvdSecCnt);
+
+        fprintf(shell->out, "BPB_NumFATS (Decimal): %d\n", img->BPB_NumFATS);
+        fprintf(shell->out, "BPB_NumFATS (HexaDecimal): 0x%x\n", img->BPB_NumFATS);
+
+        fprintf(shell->out, "BPB_FATSz32 (Decimal): %d\n", img->BPB_FATSz32);
+        fprintf(shell->out, "BPB_FATSz32 (HexaDecimal): 0x%x\n", img->BPB_FATSz32);  
+    }
+}
+
+void cmdLs(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if(img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+
+    else
+    {
+        // if there is only one command without argument, call ls()
+        // also call ls() to print same directory content if first argument if "."
+        if (token_count == 2)
+        {
+            ls(shell, shell->currentDirectory);
+        }
+
+        else if (token_count == 3)
+        {
+            if (strcmp(token[1], ".") == 0)
+            {
+                ls(shell, shell->currentDirectory);
+            }
+
+            else
+            {
+                // entry of the parent or child directory to list
+                struct DirectoryEntry entry;
+
+                // printing error if no any folder is found
+                if(!fat32__resolvePath(img, shell->currentDirectory, token[1], &entry) || !(entry.DIR_Attr & ATTR_DIRECTORY))
+                {
+                    commandError(shell, "Error: Invalid argument for directory with ls command.\n");
+                }
+
+                // else listing the directory content of the argument passed
+                else 
+                {
+                    ls(shell, fat32__dirCluster(img, &entry));
+                }
+            }
+        }
+
+    }  
+}
+
+//Cd command executed when the user wants to change directory
+void cmdCd(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if(img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+    //Avoiding segfault keeping some arguments checks
+    else if(img != NULL && (token_count != 3))
+    {
+        commandError(shell, "ERRORR: Invalid number of arguments for cd command.\n");
+    }
+    //Comparing if a file is found, the lowcluster is recorded.
+    //The cluster can't be 0, to cd into root, so its set to BPB_RootClus when 0.
+    //The cluster becomes the current directory.
+    else
+    {
+        struct DirectoryEntry entry;
+
+      //If not able to get the directory, just print the message
+        if(!fat32__resolvePath(img, shell->currentDirectory, token[1], &entry) || !(entry.DIR_Attr & ATTR_DIRECTORY))
+        {
+            commandError(shell, "Error: Directory not found\n");
+        }
+
+        else
+        {
+            shell->currentDirectory = fat32__dirCluster(img, &entry);
+        }
+    }
+}
+
+//When user wants to 'read' file
+void cmdRead(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if(img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+
+    else
+    {
+      //Making sure the program doesn't segfault when invalid format
+      //of read command is entered in the system
+      //read --raw sends the bytes themselves
+        if (token_count >= 2 && token[1] != NULL && strcmp(token[1], "--raw") == 0)
+        {
+            struct DirectoryEntry entry;
+
+            if (token_count < 6 || token[4] == NULL)
+            {
+                commandError(shell, "Error: Must provide filename, position, and number of bytes to read.\n");
+            }
+            else if (!fat32__resolvePath(img, shell->currentDirectory, token[2], &entry) || (entry.DIR_Attr & ATTR_DIRECTORY))
+            {
+                commandError(shell, "Error: File not found\n");
+            }
+            else
+            {
+                if (sendFile(shell, &entry, strtoul(token[3], NULL, 0), strtoul(token[4], NULL, 0)) != 0)
+                {
+                    commandError(shell, errno == EIO ? "Error: Unable to read %s from the image\n"
+                                                     : "Error: Unable to write %s\n", token[2]);
+                }
+            }
+        }
+
+        else if (token_count < 5)
+        {
+            commandError(shell, "Error: Must provide filename, position, and number of bytes to read.\n");
+        }
+      //Calling the readFile function and passing the filename,position number
+      //and number of bytes as collected from users in token. Atoi for integer conversion
+
+        else
+        {
+            readfile(shell, token[1], (int) atoi( token[2] ), (int)atoi( token[3] ));
+        }
+    }
+}
+
+//cat writes the whole file out as it is
+void cmdCat(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    struct DirectoryEntry entry;
+
+    if(img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+
+    else if (token_count != 3)
+    {
+        commandError(shell, "ERROR: Usage: cat <file>\n");
+    }
+
+    else if (!fat32__resolvePath(img, shell->currentDirectory, token[1], &entry) || (entry.DIR_Attr & ATTR_DIRECTORY))
+    {
+        commandError(shell, "Error: File not found\n");
+    }
+
+    else
+    {
+        if (sendFile(shell, &entry, 0, entry.DIR_FileSize) != 0)
+        {
+            commandError(shell, errno == EIO ? "Error: Unable to read %s from the image\n"
+                                             : "Error: Unable to write %s\n", token[1]);
+        }
+    }
+}
+
+void cmdStat(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if(img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+    //When a file is not empty, looping through to find the file
+    //when found print the name, attribute, size and cluster.
+    else if (img != NULL && token_count == 3)
+    {
+        struct DirectoryEntry entry;
+
+      //if no file is found
+        if(!fat32__resolvePath(img, shell->currentDirectory, token[1], &entry))
+        {
+            commandError(shell, "Error: File not found\n");
+        }
+
+        else
+        {
+            //The extent count shows how fragmented the file is
+            struct Extent *extents;
+            int extentCount = fat32__buildExtents(img, fat32__firstCluster(&entry), entry.DIR_FileSize, &extents);
+            free(extents);
+
+            fprintf(shell->out, "%s Attr: %d Size: %d Cluster: %d Extents: %d\n", token[1], entry.DIR_Attr,entry.DIR_FileSize,fat32__firstCluster(&entry), extentCount);
+        }
+    }
+
+    else
+    {
+        commandError(shell, "ERROR: Invalid number of arguments for stat command.\n");
+    }
+}
+
+//fatcache command switches chain walks between the in-memory FAT
+//and reading each entry from the image
+void cmdFatCache(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if (token_count == 2)
+    {
+        fprintf(shell->out, "fatcache: %s\n", fatCacheEnabled ? "on" : "off");
+    }
+
+    else if (token_count == 3 && strcmp(token[1], "on") == 0)
+    {
+        fatCacheEnabled = true;
+        if (img != NULL && img->FAT == NULL && fat32__loadFAT(img) != 0)
+        {
+            commandError(shell, "Error: Unable to load the FAT.\n");
+        }
+    }
+
+    else if (token_count == 3 && strcmp(token[1], "off") == 0)
+    {
+        fatCacheEnabled = false;
+        if (img != NULL)
+        {
+            fat32__freeFAT(img);
+        }
+    }
+
+    else
+    {
+        commandError(shell, "ERROR: Usage: fatcache on|off\n");
+    }
+}
+
+//iosize command sets the largest single transfer get will issue
+void cmdIOSize(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if (token_count == 2)
+    {
+        fprintf(shell->out, "iosize: %zu\n", MaxIOSize);
+    }
+
+    else if (token_count == 3 && atol(token[1]) >= MIN_IO_SIZE)
+    {
+        MaxIOSize = atol(token[1]);
+        if (img != NULL)
+        {
+            img->maxIOSize = MaxIOSize;
+        }
+    }
+
+    else
     {
-        strncpy((char*)(expanded_name + 8), token, strlen(token));
+        commandError(shell, "ERROR: Usage: iosize <bytes>, at least 512\n");
     }
+}
 
-    int i;
+//zerocopy command switches get between kernel copies and read/write
+void cmdZeroCopy(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
 
-    for(i = 0; i < 11; i++)
+    if (token_count == 2)
     {
-        expanded_name[i] = toupper(expanded_name[i]);
+        fprintf(shell->out, "zerocopy: %s\n", zeroCopyEnabled ? "on" : "off");
     }
 
-    if(strncmp(expanded_name, IMG_Name, 11) == 0)
+    else if (token_count == 3 && strcmp(token[1], "on") == 0)
     {
-        return 1;
+        zeroCopyEnabled = true;
+        if (img != NULL)
+        {
+            img->zeroCopy = true;
+        }
     }
 
-    return 0;
-}
-
-//Ls function to list files which are undeleted.
-void ls()
-{
-    int i;
-    for (i = 0; i < 16; i++)
+    else if (token_count == 3 && strcmp(token[1], "off") == 0)
     {
-        char filename[12];
-        strncpy(filename, Dir[i].DIR_Name, 11);
-        filename[11]='\0';
-        if ((Dir[i].DIR_Attr == ATTR_READ_ONLY || Dir[i].DIR_Attr ==ATTR_DIRECTORY 
-        || Dir[i].DIR_Attr == ATTR_ARCHIVE) && filename[0] != 0xffffffe5)
+        zeroCopyEnabled = false;
+        if (img != NULL)
         {
-            printf("%s\n", filename );
+            img->zeroCopy = false;
         }
     }
+
+    else
+    {
+        commandError(shell, "ERROR: Usage: zerocopy on|off\n");
+    }
 }
 
-//This function requires the filename, position and a position parameter to 
-//specify the number of bytes in hexadecimal. 
-int readfile( char *filename, int requested_Offset, int requestedBytes)
+//cache command sizes the block cache, sets the readahead depth and
+//reports how well it is doing
+void cmdCache(struct Shell *shell, char **token, int token_count)
 {
-    int i;
-    int got=0;
-    int bytesRemainingToRead = requestedBytes;
-    
-    if(requested_Offset < 0)
+    struct Image *img = shell->img;
+
+    if (img == NULL)
     {
-        printf("Error: offset can't be negative\n");
+        commandError(shell, "ERROR: File System image must be opened first.\n");
     }
 
-    for(i = 0; i < 16; i++)
+    else if (token_count == 2)
     {
-        if(compare(filename, Dir[i].DIR_Name))
-        {
-            int cluster = Dir[i].DIR_FirstClusterLow;
-            got = 1;
-
-            int SearchSize = requested_Offset;
-
-            while(SearchSize >= BPB_BytesPerSec)
-            {
-                cluster = NextLB( cluster );
-                SearchSize = SearchSize - BPB_BytesPerSec;
-            }
-          //The cluster is passed to the LBA to get the offset
-          //Then fseek to the offset and sum of byteoffset
-            int offset = LBAToOffset( cluster );
-            int byteOffset = ( requested_Offset % BPB_BytesPerSec );
-            fseek(fp, offset + byteOffset, SEEK_SET);
-
-          //First block bytes that needs to be read 
-
-            unsigned char buffer [ BPB_BytesPerSec ];
-
-            int firstBlockBytes = BPB_BytesPerSec - requested_Offset;
+        fprintf(shell->out, "cache size: %d clusters, readahead: %d clusters\n", img->cache.capacity, img->cache.readahead);
+    }
 
-            fread(buffer, 1, firstBlockBytes, fp);
-            //fread(buffer,1,byteOffset,fp);
+    else if (token_count == 3 && strcmp(token[1], "stats") == 0)
+    {
+        unsigned long lookups = img->cache.hits + img->cache.misses;
 
-            for(i = 0; i < firstBlockBytes; i++)
-            {
-                printf("%x ", buffer[i]);
-            }
-            
-          //Middle block bytes to be read
-            bytesRemainingToRead = bytesRemainingToRead - firstBlockBytes;
+        fprintf(shell->out, "Hits: %lu Misses: %lu Hit rate: %.1f%%\n", img->cache.hits, img->cache.misses,
+               lookups ? 100.0 * img->cache.hits / lookups : 0.0);
+        fprintf(shell->out, "Prefetched: %lu Cached: %d Bytes saved: %llu\n", img->cache.prefetched, img->cache.count,
+               img->cache.bytesSaved);
+        fprintf(shell->out, "Dentry hits: %lu Dentry misses: %lu\n", img->dentryHits, img->dentryMisses);
+    }
 
-            while(bytesRemainingToRead >= 512)
-            {
-                cluster = NextLB( cluster );
-                offset = LBAToOffset( cluster );
-                fseek(fp, offset , SEEK_SET);
-                fread(buffer, 1, BPB_BytesPerSec, fp);
+    else if (token_count == 3 && strcmp(token[1], "clear") == 0)
+    {
+        //Dropping the directory indexes makes the next lookups
+        //see any change made to the image since they were built
+        fat32__cacheClear(img);
+        fat32__freeDirIndexes(img);
+        fat32__dentryClear(img);
+    }
 
-                for(i = 0; i < BPB_BytesPerSec; i++)
-                {
-                    printf("%x ", buffer[i]);
-                }
-              //Last block bytes to be read
-            bytesRemainingToRead = bytesRemainingToRead - BPB_BytesPerSec;
-            }
+    else if (token_count == 4 && strcmp(token[1], "size") == 0 && atoi(token[2]) >= 0)
+    {
+        //Bucket count follows the size, so start over with an empty cache
+        fat32__cacheClear(img);
+        img->cache.capacity = atoi(token[2]);
+    }
 
-            if( bytesRemainingToRead)
-            {
-                cluster = NextLB( cluster );
-                offset = LBAToOffset( cluster );
-                fseek(fp, offset, SEEK_SET);
-                fread(buffer, 1, bytesRemainingToRead, fp);
-            
-                for(i=0; i< bytesRemainingToRead; i++)
-                {
-                    printf("%x ", buffer[i]);
-                }
-            }
-            
-            printf("\n");
-        }
+    else if (token_count == 4 && strcmp(token[1], "readahead") == 0 && atoi(token[2]) >= 0)
+    {
+        img->cache.readahead = atoi(token[2]);
     }
 
-    if(!got)
+    else
     {
-        printf("Error: File not found\n");
-        return -1;
+        commandError(shell, "ERROR: Usage: cache [stats|clear|size <clusters>|readahead <clusters>]\n");
     }
 }
 
-//getFile function to retreive files/directory in place in current directory
-void getFile(char *olderfilename, char *newfilename)
+//tree, du and find walk everything below a directory on one
+//thread per CPU, then print in directory order
+void cmdWalk(struct Shell *shell, char **token, int token_count)
 {
+    struct Image *img = shell->img;
 
-    FILE *oldpointer;
-    FILE *tempFp = fopen(olderfilename, "r");
+    bool find = strcmp("find", token[0]) == 0;
+    char *path = find ? (token_count > 2 ? token[2] : NULL) : token[1];
+    struct DirectoryEntry entry;
 
-    // Checking if the file or folder already exists or not
-    // if not, the check is updated to 1 and then error is thrown
-    int check = 0;
-    for (int i = 0; i < 16; i++)
+    if (img == NULL)
     {
-        if (compare(olderfilename, Dir[i].DIR_Name ) && strcmp(olderfilename, "..") != 0)
-        {
-            check = 1;
-        }
+        commandError(shell, "ERROR: File System image must be opened first.\n");
     }
 
-    if (check == 0)
+    else if ((find && (token_count < 3 || token_count > 4 || token[1] == NULL)) || (!find && token_count > 3))
     {
-        printf("ERROR: File not found.\n");
-        return;
+        commandError(shell, "ERROR: Usage: tree [dir], du [dir], find <pattern> [dir]\n");
     }
-  //opening the original file incase new file is not provided.
-    if(newfilename == NULL)
+
+    else if (!fat32__resolvePath(img, shell->currentDirectory, path ? path : ".", &entry) || !(entry.DIR_Attr & ATTR_DIRECTORY))
     {
-        oldpointer = fopen(olderfilename, "w");
-        if(oldpointer == NULL)
-        {
-            printf("Error: Cant open new file %s\n", olderfilename);
-        }
+        commandError(shell, "Error: Directory not found\n");
     }
+
     else
     {
-        oldpointer = fopen(newfilename, "w");
+        struct WalkNode *root = fat32__walkTree(img, &entry, path ? path : ".", fat32__walkWorkers());
+        //The branch prefix of tree or the path of du and find
+        char *buffer = (char*) arenaAlloc(&shell->arena, WALK_PATH_SIZE);
 
-        if(oldpointer == NULL)
+        if (buffer == NULL)
         {
-            printf("Error: Cant open new file %s\n", newfilename);
+            commandError(shell, "Error: Out of command memory\n");
         }
-    }
+        else if (strcmp("tree", token[0]) == 0)
+        {
+            int directories = 0;
+            int files = 0;
 
-    int i;
-    int got = 0;
-   //Handling sections of file
-    for(i = 0; i < 16 ; i++)
-    {
-        if(compare(olderfilename, Dir[i].DIR_Name ) )
+            buffer[0] = '\0';
+            fprintf(shell->out, "%s\n", root->name);
+            printTree(shell, root, buffer, 0, &directories, &files);
+            fprintf(shell->out, "\n%d directories, %d files\n", directories, files);
+        }
+        else
         {
-            int cluster = Dir[i].DIR_FirstClusterLow;
-            got = 1;
-            int byteremainingtoread = Dir[i].DIR_FileSize;
-            int offset= 0;
-            unsigned char buffer[512];
-          
-            while(byteremainingtoread >= BPB_BytesPerSec)
+            size_t length = appendPath(buffer, 0, WALK_PATH_SIZE, root->name);
+
+            if (find)
             {
-                offset = LBAToOffset(cluster);
-                fseek(fp, offset, SEEK_SET);
-                fread(buffer, 1, BPB_BytesPerSec, fp);
-                fwrite(buffer, 1, 512, oldpointer);
-                cluster = NextLB(cluster);
-                byteremainingtoread = byteremainingtoread - BPB_BytesPerSec;
+                printMatches(shell, root, buffer, length, token[1]);
             }
-
-            //Handling the last block
-
-            if(byteremainingtoread)
+            else
             {
-                offset = LBAToOffset(cluster);
-                fseek(fp, offset, SEEK_SET);
-                fread(buffer, 1, byteremainingtoread,fp);
-                fwrite(buffer,1,byteremainingtoread,oldpointer);
+                printDiskUsage(shell, root, buffer, length);
             }
-            fclose(oldpointer);
         }
+        fat32__freeWalkTree(root, true);
     }
 }
 
-
-
-
-int main()
+//mget copies every file of a directory matching a glob, like
+//BIGDIR/*.DAT, into a host directory, the current one by default
+void cmdMget(struct Shell *shell, char **token, int token_count)
 {
-    bool isOpen = false;
-    
-    char * cmd_str = (char*) malloc( MAX_COMMAND_SIZE );
+    struct Image *img = shell->img;
 
-    while( 1 )
+    if (img == NULL)
     {
-        // Print out the mfs prompt
-        printf ("mfs> ");
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+
+    else if (token_count != 3 && token_count != 4)
+    {
+        commandError(shell, "ERROR: Usage: mget <glob> [hostdir]\n");
+    }
 
-        // Read the command from the commandline.  The
-        // maximum command that will be read is MAX_COMMAND_SIZE
-        // This while command will wait here until the user
-        // inputs something since fgets returns NULL when there
-        // is no input
-        while( !fgets (cmd_str, MAX_COMMAND_SIZE, stdin) );
+    else
+    {
+        //The directory part of the glob is a plain path
+        char *slash = strrchr(token[1], '/');
+        struct DirectoryEntry entry;
+        bool found;
 
-        if (cmd_str[0] == '\n')
+        if (slash == NULL)
         {
-            continue;
+            found = fat32__resolvePath(img, shell->currentDirectory, ".", &entry);
         }
-
-        /* Parse input */
-        char *token[MAX_NUM_ARGUMENTS];
-
-        int   token_count = 0;                                 
-                                                            
-        // Pointer to point to the token
-        // parsed by strsep
-        char *arg_ptr;                                         
-                                                            
-        char *working_str  = strdup( cmd_str );                
-
-        // we are going to move the working_str pointer so
-        // keep track of its original value so we can deallocate
-        // the correct amount at the end
-        char *working_root = working_str;
-
-        // Tokenize the input stringswith whitespace used as the delimiter
-        while ( ( (arg_ptr = strsep(&working_str, WHITESPACE ) ) != NULL) && 
-                (token_count<MAX_NUM_ARGUMENTS))
+        else
         {
-            token[token_count] = strndup( arg_ptr, MAX_COMMAND_SIZE );
-            if( strlen( token[token_count] ) == 0 )
-            {
-                token[token_count] = NULL;
-            }
-            token_count++;
+            *slash = '\0';
+            found = fat32__resolvePath(img, shell->currentDirectory, slash == token[1] ? "/" : token[1], &entry);
         }
 
-        // Now print the tokenized input as a debug check
-        // \TODO Remove this code and replace with your FAT32 functionality
-      
-      //Open command to open file in read mode
-        if (strcmp("open", token[0]) == 0)
+        if (!found || !(entry.DIR_Attr & ATTR_DIRECTORY))
         {
-            if (fp != NULL)
-            {
-                isOpen = true;
-                printf("ERROR: File System image already open.\n");
-                continue;
-            }
-        
-            else if (fp == NULL && token_count < 4)
-            {
-                if ((fp = fopen(token[1], "r")) == NULL)
-                {
-                    printf("Error: File system image not found.\n");
-                    continue;
-                }
-            //seeking and reading the file to get required values for the specified
-            //Used FatSpec.pdf to gather the value for limitations  for position and bytes
-                fseek(fp, 11, SEEK_SET);
-                fread(&BPB_BytesPerSec, 2, 1, fp);
-
-                fseek(fp, 13, SEEK_SET);
-                fread(&BPB_SecPerClus, 1, 1, fp);
-
-                fseek(fp, 14, SEEK_SET);
-                fread(&BPB_RsvdSecCnt, 2, 1, fp);
-
-                fseek(fp, 16, SEEK_SET);
-                fread(&BPB_NumFATS, 1, 2, fp);
-
-                fseek(fp, 36, SEEK_SET);
-                fread(&BPB_FATSz32, 4, 1, fp);  
-
-                int root = (BPB_RsvdSecCnt * BPB_BytesPerSec) + (BPB_NumFATS * BPB_FATSz32 * BPB_BytesPerSec);
-
-                // fseek(fp,0x100400,SEEK_SET);
-                fseek(fp,root,SEEK_SET);
-
-                fread(Dir,sizeof(struct DirectoryEntry),16,fp);
-               
-                
-            }
-
-            else
-            {
-                printf("ERROR: Too many arguments for open command.\n");
-            }
-            
+            commandError(shell, "Error: Directory not found\n");
         }
-      //Close command, checks if file is open and then closes the file
-      //Sets file pointer to null after file is closed.
-        else if (strcmp("close", token[0]) == 0)
+        else
         {
-            if (fp != NULL)
-            {
-                fclose(fp);
-                fp = NULL;
-            }
+            const char *pattern = slash ? slash + 1 : token[1];
+            const char *hostDir = token[2] ? token[2] : ".";
+            struct CopyStats stats;
+            int status = fat32__mget(img, fat32__dirCluster(img, &entry), pattern, hostDir, &stats);
 
-            else
+            if (status == -2)
             {
-                printf("Error: File system not open. \n");
+                commandError(shell, "Error: No files match %s\n", pattern);
             }
-        }
-
-        //bpb command for the file systems info in both decimal and hexadecimal system
-        else if (strcmp("bpb", token[0]) == 0)
-        {
-            if(fp == NULL)
+            else if (status != 0)
             {
-                printf("ERROR: File System image must be opened first.\n");
+                commandError(shell, "Error: Cant create directory %s\n", hostDir);
             }
-
             else
             {
-                printf("BPB_BytesPerSec(Decimal): %d\n", BPB_BytesPerSec);
-                printf("BPB_BytesPerSec(HexaDecimal): 0x%x\n", BPB_BytesPerSec);
-
-                printf("BPB_SecPerClus(Decimal): %d\n", BPB_SecPerClus);
-                printf("BPB_SecPerClus (HexaDecimal): 0x%x\n", BPB_SecPerClus);
+                printCopyStats(shell, &stats);
+            }
+        }
+    }
+}
 
-                printf("BPB_RsvdSecCnt (Decimal): %d\n", BPB_RsvdSecCnt);
-                printf("BPB_RsvdSecCnt (HexaDecimal): 0x%x\n", BPB_RsvdSecCnt);
+//index command writes, loads or drops the sidecar index and shows
+//what the loaded one holds
+void cmdIndex(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
 
-                printf("BPB_NumFATS (Decimal): %d\n", BPB_NumFATS);
-                printf("BPB_NumFATS (HexaDecimal): 0x%x\n", BPB_NumFATS);
+    if (img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
 
-                printf("BPB_FATSz32 (Decimal): %d\n", BPB_FATSz32);
-                printf("BPB_FATSz32 (HexaDecimal): 0x%x\n", BPB_FATSz32);  
-            }
+    else if (token_count == 2)
+    {
+        if (img->sidecar == NULL)
+        {
+            fprintf(shell->out, "No index loaded.\n");
+        }
+        else
+        {
+            const struct SidecarHeader *header = img->sidecar->header;
+            fprintf(shell->out, "Index: %s Nodes: %u Extents: %u\n", img->sidecar->path, header->nodeCount, header->extentCount);
+            fprintf(shell->out, "Free clusters: %u of %u (%llu bytes) Free runs: %u Largest run: %u clusters\n",
+                   header->freeClusters, header->totalClusters,
+                   (unsigned long long)header->freeClusters * header->bytesPerCluster,
+                   header->freeRuns, header->largestFreeRun);
+        }
+    }
 
+    else if ((token_count == 3 || token_count == 4) && strcmp(token[1], "write") == 0)
+    {
+        char *indexPath = token[2] ? strdup(token[2]) : fat32__sidecarDefaultPath(img);
+        if (fat32__sidecarWrite(img, indexPath) != 0)
+        {
+            commandError(shell, "Error: Unable to write the index %s\n", indexPath);
         }
+        free(indexPath);
+    }
 
-        else if (strcmp("ls", token[0]) == 0)
+    else if ((token_count == 3 || token_count == 4) && strcmp(token[1], "load") == 0)
+    {
+        char *indexPath = token[2] ? strdup(token[2]) : fat32__sidecarDefaultPath(img);
+        int status = fat32__sidecarLoad(img, indexPath);
+        if (status == -1)
         {
-            if(fp == NULL)
-            {
-                printf("ERROR: File System image must be opened first.\n");
-            }
+            commandError(shell, "Error: Index %s not found\n", indexPath);
+        }
+        else if (status == -2)
+        {
+            commandError(shell, "Error: Index %s is out of date or damaged\n", indexPath);
+        }
+        else
+        {
+            //Directory indexes built from the image are dropped
+            //so later lookups are served from the sidecar
+            fat32__freeDirIndexes(img);
+        }
+        free(indexPath);
+    }
 
-            else
-            {
-                // if there is only one command without argument, call ls()
-                // also call ls() to print same directory content if first argument if "."
-                if (token_count == 2)
-                {
-                    ls();
-                }
+    else if (token_count == 3 && strcmp(token[1], "drop") == 0)
+    {
+        fat32__sidecarUnload(img);
+        fat32__freeDirIndexes(img);
+    }
 
-                else if (token_count == 3)
-                {
-                    if (strcmp(token[1], ".") == 0)
-                    {
-                        ls();
-                    }
-
-                    else
-                    {
-                        int i;
-                        int got = 0;
-
-                        // defining new temprorary directory struct to store details of parent or child
-                        // directory
-                        struct DirectoryEntry TempDir[16];
-
-                        for (i = 0; i < 16; i++)
-                        {
-                            if(compare(token[1], Dir[i].DIR_Name))
-                            {
-                                int cluster = Dir[i].DIR_FirstClusterLow;
-                                if(cluster == 0)
-                                {
-                                    cluster = 2;
-                                }
-                                int offset = LBAToOffset(cluster);
-                                fseek(fp,offset,SEEK_SET);
-                                fread(TempDir, sizeof(struct DirectoryEntry), 16, fp);
-                                got = 1;
-                                break;
-                            }
-                        }
-
-                        // printing error if no any folder is found
-                        if(!got)
-                        {
-                            printf("Error: Invalid argument for directory with ls command.\n");
-                        }
-
-                        // else listing the directory content of the argument passed
-                        else 
-                        {
-                            for (i = 0; i < 16; i++)
-                            {
-                                char filename[12];
-                                strncpy(filename, TempDir[i].DIR_Name, 11);
-                                filename[11]='\0';
-                                if ((TempDir[i].DIR_Attr == ATTR_READ_ONLY || TempDir[i].DIR_Attr ==ATTR_DIRECTORY 
-                                || TempDir[i].DIR_Attr == ATTR_ARCHIVE) && filename[0] != 0xffffffe5)
-                                {
-                                    printf("%s\n", filename );
-                                }
-
-                            }
-                        }
-                    }
-                }
-                
-            }  
+    else
+    {
+        commandError(shell, "ERROR: Usage: index [write [path]|load [path]|drop]\n");
+    }
+}
 
-            
-        }
-       //Cd command executed when the user wants to change directory
-        else if (strcmp("cd", token[0]) == 0)
+//Command 'get' to retreive file and place into current directory.
+void cmdGet(struct Shell *shell, char **token, int token_count)
+{
+    struct Image *img = shell->img;
+
+    if(img == NULL)
+    {
+        commandError(shell, "ERROR: File System image must be opened first.\n");
+    }
+    //Making sure that the arguments provided by users are valid using token counts
+    //get -j N splits the copy across N threads, get -r copies a whole
+    //directory tree into a host directory
+    else
+    {
+        char *names[2] = { NULL, NULL };
+        int nameCount = 0;
+        int workers = 0;
+        bool recursive = false;
+        bool badOption = false;
+        int t;
+
+        for (t = 1; t < token_count && token[t] != NULL; t++)
         {
-            if(fp == NULL)
+            if (strcmp(token[t], "-j") == 0 && token[t + 1] != NULL && atoi(token[t + 1]) >= 1)
             {
-                printf("ERROR: File System image must be opened first.\n");
+                workers = atoi(token[++t]);
             }
-        //Avoiding segfault keeping some arguments checks
-            else if(fp != NULL && (token_count != 3))
+            else if (strcmp(token[t], "-r") == 0)
             {
-                printf("ERRORR: Invalid number of arguments for cd command.\n");
+                recursive = true;
+            }
+            else if (nameCount < 2 && token[t][0] != '-')
+            {
+                names[nameCount++] = token[t];
             }
-        //Comparing if a file is found, the lowcluster is recorded.
-        //The cluster can't be 0, to cd into root, so its set to 2 when 0.
-        //The offset is acheived by passing the cluster to the LBAToOffset
-        //The fseek seeks the offset, and once found its read in to the Dir array.
             else
             {
-                int i;
-                int got =0;
-                
-                for (i = 0; i < 16; i++)
-                {
-                    if(compare(token[1], Dir[i].DIR_Name))
-                    {
-                        int cluster = Dir[i].DIR_FirstClusterLow;
-                        if(cluster == 0)
-                        {
-                            cluster = 2;
-                        }
-                        
-                        int offset = LBAToOffset(cluster);
-                        fseek(fp,offset,SEEK_SET);
-                        fread(Dir, sizeof(struct DirectoryEntry), 16, fp);
-                        got=1;
-                        break;
-                    }
-                }
-              //If not able to get file , just print the message
-                if(!got)
-                {
-                    printf("Error: Directory not found\n");
-                }
+                badOption = true;
             }
-            
         }
 
-      //When user wants to 'read' file
-        else if (strcmp("read", token[0]) == 0)
+        if (badOption || nameCount == 0 || (recursive && nameCount != 2))
+        {
+            commandError(shell, "ERROR: Usage: get [-j N] <file> [newfile], get -r [-j N] <dir> <hostdir>\n");
+        }
+
+        else if (recursive)
         {
-           
+            struct DirectoryEntry entry;
 
-            if(fp == NULL)
+            if (!fat32__resolvePath(img, shell->currentDirectory, names[0], &entry) || !(entry.DIR_Attr & ATTR_DIRECTORY))
             {
-                printf("ERROR: File System image must be opened first.\n");
+                commandError(shell, "Error: Directory not found\n");
             }
-           
             else
             {
-              //Making sure the program doesn't segfault when invalid format
-              //of read command is entered in the system
-              
-                if (token_count < 5)
+                //Copies wait on the device more than the CPU, so
+                //use a few threads even on a small machine
+                if (workers == 0)
+                {
+                    workers = fat32__walkWorkers() < 4 ? 4 : fat32__walkWorkers();
+                }
+                struct CopyStats stats;
+
+                if (fat32__getTree(img, &entry, names[0], names[1], workers, &stats) != 0)
                 {
-                    printf("Error: Must provide filename, position, and number of bytes to read.\n");
+                    commandError(shell, "Error: Cant create directory under %s\n", names[1]);
                 }
-              //Calling the readFile function and passing the filename,position number
-              //and number of bytes as collected from users in token. Atoi for integer conversion
-             
                 else
                 {
-                    readfile( token[1], (int) atoi( token[2] ), (int)atoi( token[3] ));
+                    printCopyStats(shell, &stats);
                 }
             }
         }
 
-        else if (strcmp("stat", token[0]) == 0)
+        else
         {
-            if(fp == NULL)
-            {
-                printf("ERROR: File System image must be opened first.\n");
-            }
-          //When a file is not empty, looping through to find the file 
-          //when found print the name, attribute, size and cluster.
-            else if (fp != NULL && token_count == 3)
-            {
-                int i;
-                int found =0;
-
-                for(i=0; i<16; i++)
-                { 
-                    if(compare((token[1]), Dir[i].DIR_Name))
-                    {
-                        printf("%s Attr: %d Size: %d Cluster: %d\n", token[1], Dir[i].DIR_Attr,Dir[1].DIR_FileSize,Dir[i].DIR_FirstClusterLow);
-                        found =1 ;
-                    }
-                }
-              //if no file is found
-                if(!found)
-                {
-                    printf("Error: File not found\n");
-                }
-            }
+            getFile(shell, names[0], names[1], workers ? workers : 1);
+        }
+    }
+}
 
-            else
-            {
-                printf("ERROR: Invalid number of arguments for stat command.\n");
-            }
-            
+//hitting quit or enter to exit the mfs file system.
+//In case any file is open, it is closed and set to null and the program exits.
+//A daemon session only ends, the image stays open for the others.
+void cmdQuit(struct Shell *shell, char **token, int token_count)
+{
+    if (!shell->shared)
+    {
+        fprintf(shell->out, "Closing the Fat32 System..\n");
+        if (shell->img != NULL)
+        {
+            fat32__imageClose(shell->img);
+            shell->img = NULL;
         }
+    }
+    shell->quit = true;
+}
+
+// Shell commands by commandHash() of their name. The hash is perfect for
+// these names, so finding a command is one probe and one strcmp; a new
+// command has to land on a free slot, or the multipliers have to change.
+#define COMMAND_SLOTS 64
 
-        //Command 'get' to retreive file and place into current directory.
+typedef void (*CommandHandler)(struct Shell *shell, char **token, int token_count);
 
+// shared marks the commands a daemon session may run: the ones that only
+// read the image and change nothing but the session's own directory
+struct Command
+{
+    const char *name;
+    CommandHandler handler;
+    bool shared;
+};
+
+static const struct Command commandTable[COMMAND_SLOTS] =
+{
+    [0] = { "zerocopy", cmdZeroCopy, false },
+    [1] = { "quit", cmdQuit, true },
+    [2] = { "get", cmdGet, true },
+    [4] = { "tree", cmdWalk, true },
+    [5] = { "stat", cmdStat, true },
+    [6] = { "close", cmdClose, false },
+    [8] = { "find", cmdWalk, true },
+    [9] = { "bpb", cmdBpb, true },
+    [24] = { "du", cmdWalk, true },
+    [25] = { "mget", cmdMget, true },
+    [28] = { "index", cmdIndex, false },
+    [31] = { "iosize", cmdIOSize, false },
+    [35] = { "exit", cmdQuit, true },
+    [36] = { "read", cmdRead, true },
+    [44] = { "ls", cmdLs, true },
+    [46] = { "cat", cmdCat, true },
+    [48] = { "cache", cmdCache, false },
+    [49] = { "open", cmdOpen, false },
+    [51] = { "cd", cmdCd, true },
+    [60] = { "fatcache", cmdFatCache, false },
+};
+
+uint32_t commandHash(const char *name)
+{
+    const unsigned char *c = (const unsigned char*) name;
+    return (c[0] * 3 + c[1] * 2 + strlen(name)) % COMMAND_SLOTS;
+}
+
+//Returns the command called name, or NULL when there is none
+const struct Command *findCommand(const char *name)
+{
+    const struct Command *command = &commandTable[commandHash(name)];
+
+    if (command->name == NULL || strcmp(command->name, name) != 0)
+    {
+        return NULL;
+    }
+    return command;
+}
+
+//Splits line into tokens in the shell's arena and runs the command they
+//name. Used by the shell for every command it reads and by the daemon for
+//every request line.
+void runCommand(struct Shell *shell, char *line)
+{
+    char **token = (char**) arenaAlloc(&shell->arena, MAX_NUM_ARGUMENTS * sizeof(char*));
+    int count = tokenize(line, token, MAX_NUM_ARGUMENTS);
+
+    if (count == 0)
+    {
+        return;
+    }
+    if (count < 0)
+    {
+        commandError(shell, "Error: Too many arguments, at most %d\n", MAX_NUM_ARGUMENTS - 2);
+        return;
+    }
+
+    //The handlers count the NULL that ends token, so a command with one
+    //argument has a token_count of 3
+    const struct Command *command = findCommand(token[0]);
+    if (command == NULL)
+    {
+        commandError(shell, "Error: Unknown command %s\n", token[0]);
+    }
+    else if (shell->shared && !command->shared)
+    {
+        commandError(shell, "Error: %s is not available in a daemon session\n", token[0]);
+    }
+    else
+    {
+        command->handler(shell, token, count + 1);
+    }
+}
 
-        else if (strcmp("get", token[0]) == 0)
+
+
+
+
+int main(int argc, char *argv[])
+{
+    struct CommandSource source;
+    const char *servePath = NULL;
+    const char *serveImage = NULL;
+    int serveWorkers = 0;
+    int a;
+
+    //Without options commands are read from stdin after a prompt. -c runs
+    //a ; separated list and -f a script, one command per line, both
+    //without a prompt and with stdout fully buffered. Exits with 1 when a
+    //command failed and 2 when the options are wrong. --serve runs the
+    //daemon on the image named last.
+    source.file = stdin;
+    source.list = NULL;
+    source.prompt = true;
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-c") == 0 && a + 1 < argc && source.prompt)
+        {
+            source.list = argv[++a];
+            source.prompt = false;
+        }
+        else if (strcmp(argv[a], "-f") == 0 && a + 1 < argc && source.prompt)
         {
-            if(fp == NULL)
+            a++;
+            source.file = strcmp(argv[a], "-") == 0 ? stdin : fopen(argv[a], "r");
+            if (source.file == NULL)
             {
-                printf("ERROR: File System image must be opened first.\n");
+                fprintf(stderr, "Error: Cant open script %s\n", argv[a]);
+                return 2;
             }
-        //Making sure that the arguments provided by users are valid using token counts
-            else if ((fp != NULL) && (token_count != 3 && token_count != 4))
+            source.prompt = false;
+        }
+        else if (strcmp(argv[a], "--serve") == 0 && a + 2 < argc && source.prompt)
+        {
+            servePath = argv[++a];
+            if (strcmp(argv[a + 1], "-j") == 0 && a + 3 < argc)
             {
-                printf("ERROR: Invalid number of arguments for get command.\n");
+                serveWorkers = atoi(argv[a + 2]);
+                a += 2;
             }
+            serveImage = argv[++a];
+            source.prompt = false;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-c \"cmd; cmd\" | -f script | --serve <socket> [-j N] <image>]\n", argv[0]);
+            return 2;
+        }
+    }
 
-            else
-            {
-                getFile(token[1], token[2]);
-            }
+    //Requests wait on the image more than the CPU, so the daemon runs a
+    //few workers even on a small machine
+    if (servePath != NULL)
+    {
+        struct fat32_options options;
+        fat32_default_options(&options);
+        options.fat_cache = fatCacheEnabled;
+        options.zero_copy = zeroCopyEnabled;
+        options.max_io_size = MaxIOSize;
+
+        struct Image *img;
+        if (serveWorkers < 0 || (img = fat32__imageOpen(serveImage, &options)) == NULL)
+        {
+            fprintf(stderr, "Error: File system image not found.\n");
+            return 2;
+        }
+        if (serveWorkers == 0)
+        {
+            serveWorkers = fat32__walkWorkers() < 4 ? 4 : fat32__walkWorkers();
         }
-        //hitting quit or enter to exit the mfs file system.
-        //In case any file is open, it is closed and set to null and the program exits.
-        else if ((strcmp("quit", token[0]) == 0) || (strcmp("exit", token[0]) == 0))
+        int status = serve(img, servePath, serveWorkers);
+        fat32__imageClose(img);
+        return status;
+    }
+
+    if (!source.prompt)
+    {
+        setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+    }
+    
+    struct Shell shell;
+    memset(&shell, 0, sizeof(shell));
+    shell.out = stdout;
+    arenaInit(&shell.arena, COMMAND_ARENA_SIZE);
+
+    while (!shell.quit)
+    {
+        //Everything one command needs comes from the arena, which is
+        //emptied before the next one is read
+        arenaReset(&shell.arena);
+        char *cmd_str = (char*) arenaAlloc(&shell.arena, MAX_COMMAND_SIZE);
+
+        // Read the command. The maximum command that will be read is
+        // MAX_COMMAND_SIZE. At the end of the input the image is closed
+        // as if quit had been typed.
+        if (!nextCommand(&shell, &source, cmd_str, MAX_COMMAND_SIZE))
         {
-            printf("Closing the Fat32 System..\n");
-            if (fp != NULL)
+            if (shell.img != NULL)
             {
-                fclose(fp);
-                fp = NULL;
+                fat32__imageClose(shell.img);
+                shell.img = NULL;
             }
             break;
         }
+
+        runCommand(&shell, cmd_str);
     }
 
-    return 0;
+    arenaFree(&shell.arena);
+    if (source.file != stdin)
+    {
+        fclose(source.file);
+    }
+    fflush(stdout);
+    return shell.failed ? 1 : 0;
 }
@@ -0,0 +1,288 @@
+
+
+// The MIT License (MIT)
+// 
+// Copyright (c) 2020 Trevor Bakker 
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// mfsbench: load generator for mfs --serve. Each client thread opens its own
+// session and sends the same command back to back, timing every request
+// from the write of the command to the last byte of the reply.
+//
+//   mfsbench <socket> [-c clients] [-n requests] [command]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <time.h>
+
+struct Client
+{
+    const char *path;
+    const char *command;
+    int requests;
+    // Nanoseconds taken by each request, filled in by the client thread
+    uint64_t *latencies;
+    int completed;
+    int errors;
+};
+
+uint64_t nowNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+//Reads exactly len bytes, returns -1 when the daemon hangs up first
+int readAll(int fd, char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t got = read(fd, buf, len);
+        if(got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(got <= 0)
+        {
+            return -1;
+        }
+        buf += got;
+        len -= got;
+    }
+    return 0;
+}
+
+//Reads one "OK <bytes>" or "ERR <bytes>" header and throws the output away
+int readReply(int fd, bool *failed)
+{
+    static __thread char discard[64 * 1024];
+    char header[32];
+    size_t used = 0;
+    unsigned long long length;
+
+    //The header is short, so it is read a byte at a time
+    while(used < sizeof(header) - 1)
+    {
+        if(readAll(fd, &header[used], 1) != 0)
+        {
+            return -1;
+        }
+        if(header[used++] == '\n')
+        {
+            break;
+        }
+    }
+    header[used] = '\0';
+
+    if(sscanf(header, "OK %llu", &length) == 1)
+    {
+        *failed = false;
+    }
+    else if(sscanf(header, "ERR %llu", &length) == 1)
+    {
+        *failed = true;
+    }
+    else
+    {
+        return -1;
+    }
+
+    while(length > 0)
+    {
+        size_t part = length < sizeof(discard) ? length : sizeof(discard);
+        if(readAll(fd, discard, part) != 0)
+        {
+            return -1;
+        }
+        length -= part;
+    }
+    return 0;
+}
+
+void *runClient(void *arg)
+{
+    struct Client *client = (struct Client*) arg;
+    struct sockaddr_un address;
+    size_t commandLength = strlen(client->command);
+    char *line = (char*) malloc(commandLength + 2);
+    int r;
+
+    sprintf(line, "%s\n", client->command);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, client->path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
+    {
+        printf("Error: Cant connect to %s: %s\n", client->path, strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        free(line);
+        return NULL;
+    }
+
+    for(r = 0; r < client->requests; r++)
+    {
+        uint64_t start = nowNanoseconds();
+        bool failed;
+
+        if(write(fd, line, commandLength + 1) != (ssize_t)(commandLength + 1) || readReply(fd, &failed) != 0)
+        {
+            printf("Error: The daemon closed the session\n");
+            break;
+        }
+        client->latencies[client->completed++] = nowNanoseconds() - start;
+        if(failed)
+        {
+            client->errors++;
+        }
+    }
+
+    close(fd);
+    free(line);
+    return NULL;
+}
+
+int compareLatencies(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+//Latency below which the given fraction of requests finished, in us
+double percentile(uint64_t *sorted, long count, double fraction)
+{
+    long i = (long)(fraction * count);
+    if(i >= count)
+    {
+        i = count - 1;
+    }
+    return sorted[i] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *command = "stat .";
+    int clients = 4;
+    int requests = 10000;
+    int a;
+    int c;
+
+    if(argc < 2)
+    {
+        printf("Usage: %s <socket> [-c clients] [-n requests] [command]\n", argv[0]);
+        return 2;
+    }
+
+    for(a = 2; a < argc; a++)
+    {
+        if(strcmp(argv[a], "-c") == 0 && a + 1 < argc)
+        {
+            clients = atoi(argv[++a]);
+        }
+        else if(strcmp(argv[a], "-n") == 0 && a + 1 < argc)
+        {
+            requests = atoi(argv[++a]);
+        }
+        else
+        {
+            command = argv[a];
+        }
+    }
+
+    if(clients < 1 || requests < 1)
+    {
+        printf("Error: clients and requests must be at least 1\n");
+        return 2;
+    }
+
+    struct Client *state = (struct Client*) calloc(clients, sizeof(struct Client));
+    pthread_t *threads = (pthread_t*) malloc(clients * sizeof(pthread_t));
+    uint64_t start = nowNanoseconds();
+
+    for(c = 0; c < clients; c++)
+    {
+        state[c].path = argv[1];
+        state[c].command = command;
+        state[c].requests = requests;
+        state[c].latencies = (uint64_t*) malloc(requests * sizeof(uint64_t));
+        if(pthread_create(&threads[c], NULL, runClient, &state[c]) != 0)
+        {
+            printf("Error: Unable to start client %d\n", c);
+            return 1;
+        }
+    }
+    for(c = 0; c < clients; c++)
+    {
+        pthread_join(threads[c], NULL);
+    }
+    double seconds = (nowNanoseconds() - start) / 1e9;
+
+    //All latencies are pooled to find the percentiles
+    long total = 0;
+    long errors = 0;
+    for(c = 0; c < clients; c++)
+    {
+        total += state[c].completed;
+        errors += state[c].errors;
+    }
+    if(total == 0)
+    {
+        printf("Error: No requests completed\n");
+        return 1;
+    }
+
+    uint64_t *all = (uint64_t*) malloc(total * sizeof(uint64_t));
+    long n = 0;
+    for(c = 0; c < clients; c++)
+    {
+        memcpy(all + n, state[c].latencies, state[c].completed * sizeof(uint64_t));
+        n += state[c].completed;
+        free(state[c].latencies);
+    }
+    qsort(all, total, sizeof(uint64_t), compareLatencies);
+
+    printf("%ld requests from %d clients in %.3f s: %.0f requests/s, %ld errors\n", total, clients, seconds,
+           total / seconds, errors);
+    printf("Latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", percentile(all, total, 0.5),
+           percentile(all, total, 0.9), percentile(all, total, 0.99), percentile(all, total, 0.999),
+           all[total - 1] / 1000.0);
+
+    free(all);
+    free(state);
+    free(threads);
+    return total == (long) clients * requests ? 0 : 1;
+}